@@ -0,0 +1,410 @@
+/* Copyright (C) 1883 Thomas Edison - All Rights Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GPLv2 license, which unfortunately won't be
+ * written for another century.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include <string.h>
+
+#include "hid-report.h"
+
+// item types and tags, HID 1.11 section 6.2.2
+#define ITEM_MAIN 0
+#define ITEM_GLOBAL 1
+#define ITEM_LOCAL 2
+#define ITEM_LONG 0xFE
+
+#define MAIN_INPUT 8
+#define MAIN_COLLECTION 10
+#define MAIN_END_COLLECTION 12
+
+#define GLOBAL_USAGE_PAGE 0
+#define GLOBAL_LOGICAL_MIN 1
+#define GLOBAL_LOGICAL_MAX 2
+#define GLOBAL_REPORT_SIZE 7
+#define GLOBAL_REPORT_ID 8
+#define GLOBAL_REPORT_COUNT 9
+#define GLOBAL_PUSH 10
+#define GLOBAL_POP 11
+
+#define LOCAL_USAGE 0
+#define LOCAL_USAGE_MIN 1
+#define LOCAL_USAGE_MAX 2
+
+#define INPUT_CONSTANT 0x01
+#define INPUT_VARIABLE 0x02
+
+#define PAGE_DESKTOP 0x01
+#define PAGE_KEYBOARD 0x07
+#define PAGE_BUTTON 0x09
+
+#define DESKTOP_MOUSE 0x02
+#define DESKTOP_KEYBOARD 0x06
+#define DESKTOP_X 0x30
+#define DESKTOP_Y 0x31
+#define DESKTOP_WHEEL 0x38
+
+#define COLLECTION_APPLICATION 1
+
+// 0xE0-0xE7, left ctrl to right gui
+#define KEY_MODIFIER_FIRST 0xE0
+// below this a keyboard array value is "no key" or a rollover error
+#define KEY_FIRST 0x04
+
+#define USAGES_MAX 8
+
+typedef struct {
+    uint16_t page;
+    int32_t logical_min;
+    int32_t logical_max;
+    uint8_t size;
+    uint8_t count;
+    uint8_t id;
+} globals_t;
+
+static uint32_t item_value(const uint8_t *data, uint8_t size) {
+    uint32_t value = 0;
+    for (uint8_t i = 0; i < size; i++) {
+        value |= (uint32_t)data[i] << (8 * i);
+    }
+    return value;
+}
+
+static int32_t item_signed(const uint8_t *data, uint8_t size) {
+    uint32_t value = item_value(data, size);
+    if (size && size < 4 && (value >> (8 * size - 1))) {
+        value |= 0xFFFFFFFFu << (8 * size);
+    }
+    return (int32_t)value;
+}
+
+static report_layout_t *layout_for(report_layout_t *layouts, uint8_t *count, uint8_t max,
+        uint8_t id, uint8_t kind) {
+    for (uint8_t i = 0; i < *count; i++) {
+        if (layouts[i].id == id) {
+            return layouts[i].kind == kind ? &layouts[i] : NULL;
+        }
+    }
+    if (*count == max) {
+        return NULL;
+    }
+    report_layout_t *layout = &layouts[(*count)++];
+    memset(layout, 0, sizeof(*layout));
+    layout->id = id;
+    layout->kind = kind;
+    return layout;
+}
+
+static void set_field(report_field_t *field, uint16_t bit, uint8_t size, uint8_t count,
+        uint32_t first, int32_t logical_min, int32_t logical_max) {
+    // the first one wins, a second bitmap or key array is usually a
+    // vendor extension we can't make sense of anyway
+    if (field->size) {
+        return;
+    }
+    field->bit = bit;
+    field->size = size;
+    field->count = count;
+    // the page is known from the field
+    field->first = first & 0xFFFF;
+    field->is_signed = logical_min < 0;
+    field->logical_min = logical_min;
+    field->logical_max = logical_max;
+}
+
+uint8_t parse_report_descriptor(report_layout_t *layouts, uint8_t max, const uint8_t *desc, uint16_t len) {
+    globals_t g = { 0 };
+    globals_t stack[2];
+    uint8_t depth = 0;
+
+    uint32_t usages[USAGES_MAX];
+    uint8_t usage_count = 0;
+    uint32_t usage_min = 0;
+    uint32_t usage_max = 0;
+
+    // application collection we are in, only keyboards and mice count
+    uint8_t collection = 0;
+    uint8_t kind = 0;
+    uint8_t found = 0;
+    const uint8_t *end = desc + len;
+
+    while (desc < end) {
+        uint8_t prefix = *desc++;
+        if (prefix == ITEM_LONG) {
+            if (desc + 2 > end) {
+                break;
+            }
+            desc += 2 + desc[0];
+            continue;
+        }
+
+        uint8_t size = prefix & 3;
+        if (size == 3) {
+            size = 4;
+        }
+        uint8_t type = (prefix >> 2) & 3;
+        uint8_t tag = prefix >> 4;
+        if (desc + size > end) {
+            break;
+        }
+        const uint8_t *data = desc;
+        uint32_t value = item_value(data, size);
+        desc += size;
+
+        if (type == ITEM_GLOBAL) {
+            switch (tag) {
+            case GLOBAL_USAGE_PAGE: g.page = value; break;
+            case GLOBAL_LOGICAL_MIN: g.logical_min = item_signed(data, size); break;
+            // only signed when the minimum is, 0 to 0xFF is often one byte
+            case GLOBAL_LOGICAL_MAX: g.logical_max = g.logical_min < 0 ? item_signed(data, size) : (int32_t)value; break;
+            case GLOBAL_REPORT_SIZE: g.size = value; break;
+            case GLOBAL_REPORT_ID: g.id = value; break;
+            case GLOBAL_REPORT_COUNT: g.count = value > 255 ? 255 : value; break;
+            case GLOBAL_PUSH:
+                if (depth < 2) {
+                    stack[depth++] = g;
+                }
+                break;
+            case GLOBAL_POP:
+                if (depth > 0) {
+                    g = stack[--depth];
+                }
+                break;
+            }
+            continue;
+        }
+
+        if (type == ITEM_LOCAL) {
+            // a 4 byte usage carries its own page in the top half
+            if (size < 4) {
+                value |= (uint32_t)g.page << 16;
+            }
+            switch (tag) {
+            case LOCAL_USAGE:
+                if (usage_count < USAGES_MAX) {
+                    usages[usage_count++] = value;
+                }
+                break;
+            case LOCAL_USAGE_MIN: usage_min = value; break;
+            case LOCAL_USAGE_MAX: usage_max = value; break;
+            }
+            continue;
+        }
+
+        if (type != ITEM_MAIN) {
+            continue;
+        }
+
+        if (tag == MAIN_COLLECTION) {
+            if (collection++ == 0) {
+                kind = 0;
+                uint32_t usage = usage_count ? usages[0] : usage_min;
+                if (value == COLLECTION_APPLICATION) {
+                    if (usage == ((PAGE_DESKTOP << 16) | DESKTOP_KEYBOARD)) {
+                        kind = REPORT_KEYBOARD;
+                    } else if (usage == ((PAGE_DESKTOP << 16) | DESKTOP_MOUSE)) {
+                        kind = REPORT_MOUSE;
+                    }
+                }
+            }
+        } else if (tag == MAIN_END_COLLECTION) {
+            if (collection > 0 && --collection == 0) {
+                kind = 0;
+            }
+        } else if (tag == MAIN_INPUT && kind) {
+            report_layout_t *l = layout_for(layouts, &found, max, g.id, kind);
+            if (l) {
+                uint16_t bit = l->bits;
+                uint32_t first = usage_count ? usages[0] : usage_min;
+
+                if (value & INPUT_CONSTANT) {
+                    // padding
+                } else if (g.page == PAGE_KEYBOARD && (value & INPUT_VARIABLE) && g.size == 1) {
+                    if ((first & 0xFFFF) == KEY_MODIFIER_FIRST && g.count >= 8) {
+                        set_field(&l->modifiers, bit, 1, 8, KEY_MODIFIER_FIRST, 0, 1);
+                    } else {
+                        set_field(&l->bitmap, bit, 1, g.count, first, 0, 1);
+                    }
+                } else if (g.page == PAGE_KEYBOARD && !(value & INPUT_VARIABLE)) {
+                    // array values pick a usage from the range, the logical
+                    // minimum being the first one
+                    set_field(&l->keys, bit, g.size, g.count, first, g.logical_min, g.logical_max);
+                } else if (g.page == PAGE_BUTTON && (value & INPUT_VARIABLE)) {
+                    set_field(&l->buttons, bit, g.size, g.count, first, 0, 1);
+                } else if (value & INPUT_VARIABLE) {
+                    // axes, each value has its own usage, either listed or
+                    // as a range
+                    for (uint8_t i = 0; i < g.count; i++) {
+                        uint32_t usage;
+                        if (usage_count) {
+                            usage = usages[i < usage_count ? i : usage_count - 1];
+                        } else {
+                            usage = usage_min + i;
+                            if (usage > usage_max) {
+                                break;
+                            }
+                        }
+                        uint16_t at = bit + i * g.size;
+                        if (usage == ((PAGE_DESKTOP << 16) | DESKTOP_X)) {
+                            set_field(&l->x, at, g.size, 1, DESKTOP_X, g.logical_min, g.logical_max);
+                        } else if (usage == ((PAGE_DESKTOP << 16) | DESKTOP_Y)) {
+                            set_field(&l->y, at, g.size, 1, DESKTOP_Y, g.logical_min, g.logical_max);
+                        } else if (usage == ((PAGE_DESKTOP << 16) | DESKTOP_WHEEL)) {
+                            set_field(&l->wheel, at, g.size, 1, DESKTOP_WHEEL, g.logical_min, g.logical_max);
+                        }
+                    }
+                }
+                l->bits += g.size * g.count;
+            }
+        }
+
+        // locals only last until the next main item
+        usage_count = 0;
+        usage_min = usage_max = 0;
+    }
+
+    // a keyboard or mouse collection with nothing we can read is no use
+    uint8_t kept = 0;
+    for (uint8_t i = 0; i < found; i++) {
+        report_layout_t *l = &layouts[i];
+        bool usable = l->kind == REPORT_KEYBOARD
+            ? (l->keys.size || l->bitmap.size || l->modifiers.size)
+            : (l->buttons.size || l->x.size);
+        if (usable) {
+            layouts[kept++] = *l;
+        }
+    }
+    return kept;
+}
+
+void boot_report_layout(report_layout_t *layout, uint8_t kind) {
+    memset(layout, 0, sizeof(*layout));
+    layout->kind = kind;
+    if (kind == REPORT_KEYBOARD) {
+        // modifiers, reserved, six keycodes
+        layout->bits = 64;
+        set_field(&layout->modifiers, 0, 1, 8, KEY_MODIFIER_FIRST, 0, 1);
+        set_field(&layout->keys, 16, 8, 6, 0, 0, 0xFF);
+    } else {
+        // buttons, x, y, wheel
+        layout->bits = 32;
+        set_field(&layout->buttons, 0, 1, 5, 1, 0, 1);
+        set_field(&layout->x, 8, 8, 1, DESKTOP_X, -127, 127);
+        set_field(&layout->y, 16, 8, 1, DESKTOP_Y, -127, 127);
+        set_field(&layout->wheel, 24, 8, 1, DESKTOP_WHEEL, -127, 127);
+    }
+}
+
+const report_layout_t *find_report_layout(const report_layout_t *layouts, uint8_t count,
+        const uint8_t **report, uint16_t *len) {
+    if (count == 0) {
+        return NULL;
+    }
+    // either every report has an ID or none of them do
+    if (layouts[0].id == 0) {
+        return &layouts[0];
+    }
+    if (*len == 0) {
+        return NULL;
+    }
+    uint8_t id = **report;
+    for (uint8_t i = 0; i < count; i++) {
+        if (layouts[i].id == id) {
+            (*report)++;
+            (*len)--;
+            return &layouts[i];
+        }
+    }
+    return NULL;
+}
+
+// up to 16 bits from anywhere in the report, 0 past the end
+static uint32_t report_bits(const uint8_t *report, uint16_t len, uint16_t bit, uint8_t size) {
+    uint32_t value = 0;
+    for (uint8_t i = 0; i < size; i++) {
+        uint16_t at = bit + i;
+        if ((at >> 3) >= len) {
+            break;
+        }
+        value |= (uint32_t)((report[at >> 3] >> (at & 7)) & 1) << i;
+    }
+    return value;
+}
+
+// value i of a field
+static int32_t field_value(const report_field_t *field, uint8_t i, const uint8_t *report, uint16_t len) {
+    uint8_t size = field->size > 16 ? 16 : field->size;
+    uint32_t value = report_bits(report, len, field->bit + i * field->size, size);
+    if (field->is_signed && size && (value >> (size - 1))) {
+        value |= 0xFFFFFFFFu << size;
+    }
+    return (int32_t)value;
+}
+
+// HID keyboard array value for too many keys down
+#define KEY_ROLLOVER 0x01
+
+bool read_keyboard_report(const report_layout_t *layout, const uint8_t *report, uint16_t len,
+        uint32_t keys[REPORT_KEY_WORDS]) {
+    memset(keys, 0, REPORT_KEY_WORDS * sizeof(keys[0]));
+
+    if (layout->modifiers.size) {
+        keys[KEY_MODIFIER_FIRST >> 5] |= report_bits(report, len, layout->modifiers.bit, 8)
+            << (KEY_MODIFIER_FIRST & 31);
+    }
+
+    const report_field_t *f = &layout->keys;
+    for (uint8_t i = 0; i < f->count; i++) {
+        // outside the logical range is no key at all
+        int32_t value = field_value(f, i, report, len);
+        if (value < f->logical_min || value > f->logical_max) {
+            continue;
+        }
+        uint32_t keycode = f->first + (uint32_t)(value - f->logical_min);
+        if (keycode == KEY_ROLLOVER) {
+            return false;
+        }
+        if (keycode >= KEY_FIRST && keycode <= 0xFF) {
+            keys[keycode >> 5] |= 1u << (keycode & 31);
+        }
+    }
+
+    f = &layout->bitmap;
+    for (uint8_t i = 0; i < f->count; i++) {
+        uint16_t at = f->bit + i;
+        if ((at >> 3) >= len) {
+            break;
+        }
+        // skip a whole byte of released keys at a time
+        if ((at & 7) == 0 && report[at >> 3] == 0 && i + 8 <= f->count) {
+            i += 7;
+            continue;
+        }
+        // some NKRO keyboards put the modifiers in here too
+        uint32_t keycode = f->first + i;
+        if (((report[at >> 3] >> (at & 7)) & 1) && keycode >= KEY_FIRST && keycode <= 0xFF) {
+            keys[keycode >> 5] |= 1u << (keycode & 31);
+        }
+    }
+    return true;
+}
+
+void read_mouse_report(const report_layout_t *layout, const uint8_t *report, uint16_t len, report_mouse_t *mouse) {
+    const report_field_t *f = &layout->buttons;
+    uint8_t count = f->count > 8 ? 8 : f->count;
+    mouse->buttons = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        if (report_bits(report, len, f->bit + i * f->size, 1)) {
+            // button 1 is bit 0, same as the boot report
+            uint32_t button = f->first + i;
+            if (button >= 1 && button <= 8) {
+                mouse->buttons |= 1u << (button - 1);
+            }
+        }
+    }
+    mouse->x = layout->x.size ? field_value(&layout->x, 0, report, len) : 0;
+    mouse->y = layout->y.size ? field_value(&layout->y, 0, report, len) : 0;
+    int32_t wheel = layout->wheel.size ? field_value(&layout->wheel, 0, report, len) : 0;
+    mouse->wheel = wheel < -128 ? -128 : wheel > 127 ? 127 : wheel;
+}
@@ -0,0 +1,78 @@
+/* Copyright (C) 1883 Thomas Edison - All Rights Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GPLv2 license, which unfortunately won't be
+ * written for another century.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// just enough of a HID report descriptor parser to find the keyboard and
+// mouse fields of report protocol devices, NKRO bitmaps and report IDs
+// included
+
+// input reports kept per interface
+#define REPORT_LAYOUT_MAX 4
+// keyboard state, one bit per keycode, 0xE0-0xE7 are the modifiers
+#define REPORT_KEY_WORDS 8
+
+#define REPORT_KEYBOARD 1
+#define REPORT_MOUSE 2
+
+typedef struct {
+    uint16_t bit;       // offset into the report, after the report ID
+    uint8_t size;       // bits per value, 0 if the report doesn't have it
+    uint8_t count;
+    uint16_t first;     // usage of the first value, or of logical_min in an array
+    bool is_signed;
+    int32_t logical_min;
+    int32_t logical_max;
+} report_field_t;
+
+typedef struct {
+    uint8_t id;         // 0 if the device doesn't use report IDs
+    uint8_t kind;       // REPORT_KEYBOARD or REPORT_MOUSE
+    uint16_t bits;      // report length
+    // keyboard
+    report_field_t modifiers;   // left ctrl to right gui, one bit each
+    report_field_t keys;        // array of keycodes, like the boot report
+    report_field_t bitmap;      // one bit per keycode (NKRO)
+    // mouse
+    report_field_t buttons;
+    report_field_t x;
+    report_field_t y;
+    report_field_t wheel;
+} report_layout_t;
+
+typedef struct {
+    uint8_t buttons;
+    int16_t x;
+    int16_t y;
+    int8_t wheel;
+} report_mouse_t;
+
+// fill layouts from a report descriptor, returns how many were found
+uint8_t parse_report_descriptor(report_layout_t *layouts, uint8_t max, const uint8_t *desc, uint16_t len);
+
+// the fixed boot protocol keyboard or mouse report
+void boot_report_layout(report_layout_t *layout, uint8_t kind);
+
+// pick the layout for a report and skip its report ID, NULL if none match
+const report_layout_t *find_report_layout(const report_layout_t *layouts, uint8_t count,
+    const uint8_t **report, uint16_t *len);
+
+// false for a rollover error, which doesn't say which keys are down
+bool read_keyboard_report(const report_layout_t *layout, const uint8_t *report, uint16_t len,
+    uint32_t keys[REPORT_KEY_WORDS]);
+void read_mouse_report(const report_layout_t *layout, const uint8_t *report, uint16_t len, report_mouse_t *mouse);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,104 @@
+import struct
+import sys
+
+# record the input a pico-usb2famikb built with INPUT_CAPTURE takes in, and
+# turn captures into input-replay.h for INPUT_REPLAY
+#
+#   famikb-capture.py start             empty the log and start its clock
+#   famikb-capture.py save <file>       write the log out and start again
+#   famikb-capture.py header <file>     input-replay.h from a capture file
+#
+# a capture file has one record a line, microseconds since the start and
+# then what core0 took in. the simulator plays them back with "replay"
+#
+#   <us> keys <usage>...                keyboard usages down, hex
+#   <us> mouse <btn> <x> <y> <wheel>    mouse report, buttons in hex
+#   <us> present <flags>                keyboard and mouse present bits
+#   <us> i2c <page> <byte>...           a host write as it arrived
+
+# configure i2c bus to use
+i2cbus = 0
+addr = 23
+# CAPTURE_PAGE and CAPTURE_RESET in pico-usb2famikb.c
+capture_page = 0x84
+capture_reset = 0x85
+# bytes to a read, the log carries on from one to the next
+chunk = 256
+
+# CAPTURE_END and the record kinds
+kinds = {1: "keys", 2: "mouse", 3: "present", 4: "i2c"}
+kindcodes = {name: kind for kind, name in kinds.items()}
+
+def format_record(kind, at, data):
+	if kinds.get(kind) == "mouse" and len(data) == 6:
+		return "%u mouse %02X %d %d %d" % ((at,) + struct.unpack("<Bhhb", bytes(data)))
+	name = kinds.get(kind, "# kind %u" % kind)
+	return " ".join(["%u %s" % (at, name)] + ["%02X" % b for b in data])
+
+def parse_record(line):
+	words = line.split()
+	at = int(words[0])
+	kind = kindcodes[words[1]]
+	if words[1] == "mouse":
+		data = list(struct.pack("<Bhhb", int(words[2], 16), int(words[3]), int(words[4]), int(words[5])))
+	else:
+		data = [int(w, 16) for w in words[2:]]
+	return kind, at, data
+
+def save(path):
+	from smbus2 import SMBus, i2c_msg
+	with SMBus(i2cbus) as bus:
+		pending = []
+		def read(n):
+			while len(pending) < n:
+				write = i2c_msg.write(addr, [capture_page])
+				data = i2c_msg.read(addr, chunk)
+				bus.i2c_rdwr(write, data)
+				pending.extend(list(data))
+			out = pending[:n]
+			del pending[:n]
+			return out
+
+		records = 0
+		with open(path, "w") as fp:
+			while True:
+				kind, length, at = struct.unpack("<BBI", bytes(read(6)))
+				if kind == 0:
+					break
+				fp.write(format_record(kind, at, read(length)) + "\n")
+				records += 1
+
+		# anything read past the end belongs to the next capture
+		bus.write_byte(addr, capture_reset)
+	print("%u records written to %s, capturing again" % (records, path))
+
+def header(path, out="input-replay.h"):
+	data = []
+	with open(path) as fp:
+		for line in fp:
+			if not line.strip() or line.lstrip().startswith("#"):
+				continue
+			kind, at, payload = parse_record(line)
+			data += list(struct.pack("<BBI", kind, len(payload), at)) + payload
+	data.append(0)
+
+	with open(out, "w") as fp:
+		fp.write("// %s, generated by i2chost/famikb-capture.py\n" % path)
+		fp.write("static const uint8_t input_replay[] = {\n")
+		for i in range(0, len(data), 12):
+			fp.write("    " + " ".join("0x%02X," % b for b in data[i:i+12]) + "\n")
+		fp.write("};\n")
+	print("%u bytes written to %s" % (len(data), out))
+
+if len(sys.argv) > 1 and sys.argv[1] == "start":
+	from smbus2 import SMBus
+	with SMBus(i2cbus) as bus:
+		bus.write_byte(addr, capture_reset)
+	print("Capturing")
+elif len(sys.argv) > 2 and sys.argv[1] == "save":
+	save(sys.argv[2])
+elif len(sys.argv) > 2 and sys.argv[1] == "header":
+	header(*sys.argv[2:4])
+else:
+	print("usage: %s start | save <file> | header <file> [out]" % sys.argv[0])
+	sys.exit(2)
@@ -0,0 +1,47 @@
+import struct
+import sys
+from smbus2 import SMBus, i2c_msg
+
+# read back pio-usb's host frame stats from a pico-usb2famikb built with
+# PIO_USB_FRAME_STATS, pass "reset" to clear them after reading
+
+# configure i2c bus to use
+i2cbus = 0
+addr = 23
+# FRAMESTATS_PAGE and FRAMESTATS_RESET in pico-usb2famikb.c
+framestats_page = 0x82
+framestats_reset = 0x83
+
+# pio_usb_host_frame_stats_t, all little endian uint32
+timings = ("frame", "sof", "setup", "in", "out")
+counters = ("naks", "crc errors", "timeouts", "overruns")
+words = 1 + len(timings) * 3 + len(counters)
+
+with SMBus(i2cbus) as bus:
+	page = framestats_page
+	if len(sys.argv) > 1 and sys.argv[1] == "reset":
+		page = framestats_reset
+
+	write = i2c_msg.write(addr, [page])
+	read = i2c_msg.read(addr, words * 4)
+	bus.i2c_rdwr(write, read)
+	values = struct.unpack("<%dI" % words, bytes(list(read)))
+
+	budget = values[0]
+	if budget == 0:
+		print("No frame stats, is the USB host running?")
+		sys.exit(1)
+	# the budget is one 1 ms frame of core clock cycles
+	mhz = budget / 1000.0
+	print("frame budget %u cycles" % budget)
+
+	for i, name in enumerate(timings):
+		count, total, hi = values[1+i*3:4+i*3]
+		if count == 0:
+			print("%-6s none" % name)
+		else:
+			mean = total / count
+			print("%-6s n %u  mean %u  max %u cycles  (%.1f / %.1f us)" % (name, count, mean, hi, mean / mhz, hi / mhz))
+
+	for i, name in enumerate(counters):
+		print("%-10s %u" % (name, values[1+len(timings)*3+i]))
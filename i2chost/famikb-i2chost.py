@@ -1,4 +1,5 @@
 import os
+import time
 import evdev as ev
 from selectors import DefaultSelector, EVENT_READ
 from smbus2 import SMBus, i2c_msg
@@ -13,6 +14,9 @@ pal = True
 abs_mouse = True
 # send hold repeats
 hold_repeat = True
+# keys and buttons are sent straight away, mouse motion is gathered up and
+# sent at most this often, once per NES frame by default
+flush_interval = 1.0 / (50 if pal else 60)
 
 # Hori Track options
 # L or R handedness (default is L)
@@ -33,11 +37,35 @@ mousebtn = [0,0,0]
 # vertical resolution references
 ntscpal = (224,240)
 
-keymap = dict()
+# v2 framing, a batch of keys and the mouse in one write
+# I2C_V2_PAGE in pico-usb2famikb.c, older firmware only has v1
+v2_page = 0x20
+v2_mouse = 0x80
+# an SMBus block is 32 bytes, less the sequence number and key count and
+# room for the mouse
+v2_max_keys = 32 - 2 - 4
+
+# the layout by evdev key code, so a key press is a list index and not a
+# name lookup. None for keys the layout doesn't have, and names evdev
+# doesn't know (KEY_ERR_OVF and friends) are left out
+keytable = [None] * (ev.ecodes.KEY_MAX + 1)
 with open("kblayout.txt") as fp:
 	for line in fp:
 		keysplode = line.split()
-		keymap[keysplode[0]] = int(keysplode[1], 16)
+		code = ev.ecodes.ecodes.get(keysplode[0])
+		if code is not None and code < len(keytable):
+			keytable[code] = int(keysplode[1], 16)
+
+# the codes checked on every event, looked up once
+BTN_LEFT = ev.ecodes.BTN_LEFT
+BTN_MIDDLE = ev.ecodes.BTN_MIDDLE
+BTN_RIGHT = ev.ecodes.BTN_RIGHT
+REL_X = ev.ecodes.REL_X
+REL_Y = ev.ecodes.REL_Y
+REL_WHEEL = ev.ecodes.REL_WHEEL
+KEY_LEFTSHIFT = ev.ecodes.KEY_LEFTSHIFT
+KEY_LEFTCTRL = ev.ecodes.KEY_LEFTCTRL
+KEY_ESC = ev.ecodes.KEY_ESC
 
 # left ctrl, left shift and esc to toggle capture
 capture_combo = [0,0,0]
@@ -125,6 +153,15 @@ with SMBus(i2cbus) as bus:
 		# test if the i2c is working
 		bus.write_block_data(23,0,[0,test,0,0,0])
 
+		# next sequence number, version, gaps and bad frames so far. v1
+		# firmware answers with the mouse x just written, 0
+		status = bus.read_i2c_block_data(23, v2_page, 6)
+		v2 = status[1] == 2
+		seq = status[0]
+		gaps = status[2] | (status[3] << 8)
+		bad = status[4] | (status[5] << 8)
+		print("Using the v%d i2c protocol" % (2 if v2 else 1))
+
 		print("pico-ps2famikb connected, taking control of input devices")
 		if kbselect:
 			activekb.grab()
@@ -132,104 +169,168 @@ with SMBus(i2cbus) as bus:
 			activemse.grab()
 		captured = True
 
+		# read but not sent yet. keys and buttons go out at the end of the
+		# evdev report they are in, motion at most every flush_interval
+		keys = []
+		btnchange = False
+		mousedirty = False
+		mousedelta = [0,0]
+		wheel = 0
+		lastflush = 0.0
+		# the report each device is still sending, up to its SYN_REPORT.
+		# keys, buttons and motion by device path
+		pending = dict()
+
 		while True:
+			timeout = None
+			if mousedirty:
+				timeout = max(0.0, lastflush + flush_interval - time.monotonic())
 			# first byte will be keyboard value, if present
 			# https://forums.nesdev.org/viewtopic.php?p=248338#p248338
-			for key, mask in selector.select():
-				msg = [0,0,0,0,0]
-				if not abs_mouse:
-					mousepos = [0,0]
-				doupdate = False
+			for key, mask in selector.select(timeout):
 				thisdev = key.fileobj
+				if thisdev.path not in pending:
+					pending[thisdev.path] = ([], dict(), [0,0,0])
+				reportkeys, reportbtn, reportrel = pending[thisdev.path]
 				for event in thisdev.read():
 					et = event.type
 					#print(et, type(et))
 					try:
-						if et == ev.ecodes.EV_KEY:
+						if et == ev.ecodes.EV_SYN:
+							if event.code == ev.ecodes.SYN_REPORT:
+								# the report is complete, take it all at once
+								keys += reportkeys
+								for i, value in reportbtn.items():
+									if mousebtn[i] != value:
+										mousebtn[i] = value
+										btnchange = True
+								if any(reportrel):
+									mousedelta[0] += reportrel[0]
+									mousedelta[1] += reportrel[1]
+									wheel += reportrel[2]
+									mousedirty = True
+							# or a SYN_DROPPED, this device's half read report
+							# is lost anyway
+							reportkeys.clear()
+							reportbtn.clear()
+							reportrel[:] = [0,0,0]
+						elif et == ev.ecodes.EV_KEY:
 							#print(ev.ecodes.keys[event.code], event.value)
 							# check if mouse buttons first
-							if "BTN_LEFT" in ev.ecodes.keys[event.code]:
-								mousebtn[0] = event.value
-								doupdate = True
-							elif ev.ecodes.keys[event.code] == "BTN_MIDDLE":
-								mousebtn[1] = event.value
-								doupdate = True
-							elif ev.ecodes.keys[event.code] == "BTN_RIGHT":
-								mousebtn[2] = event.value
-								doupdate = True
-							elif ev.ecodes.keys[event.code] in keymap:
+							code = event.code
+							if code == BTN_LEFT:
+								reportbtn[0] = event.value
+							elif code == BTN_MIDDLE:
+								reportbtn[1] = event.value
+							elif code == BTN_RIGHT:
+								reportbtn[2] = event.value
+							elif code < len(keytable) and keytable[code] is not None:
 								if hold_repeat or event.value < 2:
-									msg[0] = keymap[ev.ecodes.keys[event.code]]
-									if event.value == 0:
-										msg[0] += 128
-								if ev.ecodes.keys[event.code] == "KEY_LEFTSHIFT":
+									keycode = keytable[code]
+									if keycode:
+										reportkeys.append(keycode + (128 if event.value == 0 else 0))
+								if code == KEY_LEFTSHIFT:
 									capture_combo[0] = 1 if event.value > 0 else 0
-								elif ev.ecodes.keys[event.code] == "KEY_LEFTCTRL":
+								elif code == KEY_LEFTCTRL:
 									capture_combo[1] = 1 if event.value > 0 else 0
-								elif ev.ecodes.keys[event.code] == "KEY_ESC":
+								elif code == KEY_ESC:
 									capture_combo[2] = 1 if event.value > 0 else 0
-								if not msg[0] == 0:
-									doupdate = True
 						elif et == ev.ecodes.EV_REL:
-							doupdate = True
 							#print(ev.ecodes.REL[event.code], event.value)
-							if abs_mouse:
-								if ev.ecodes.REL[event.code] == "REL_X":
-									mousepos[0] = min(255, max(0, mousepos[0]+event.value))
-								elif ev.ecodes.REL[event.code] == "REL_Y":
-									mousepos[1] = min(ntscpal[pal]-1, max(0, mousepos[1]+event.value))
-							else:
-								if ev.ecodes.REL[event.code] == "REL_X":
-									if event.value < 0:
-										mousepos[0] = max(-128, event.value)
-									else:
-										mousepos[0] = min(127, event.value)
-								elif ev.ecodes.REL[event.code] == "REL_Y":
-									if event.value < 0:
-										mousepos[1] = max(-128, event.value)
-									else:
-										mousepos[1] = min(127, event.value)
-							if ev.ecodes.REL[event.code] == "REL_WHEEL":
-								msg[4] += (c_int8(event.value).value & 0x0F) << 3
-							#print("mouse cursor at: ", mousepos, mousebtn)
+							if event.code == REL_X:
+								reportrel[0] += event.value
+							elif event.code == REL_Y:
+								reportrel[1] += event.value
+							elif event.code == REL_WHEEL:
+								reportrel[2] += event.value
 					except:
 						print(event)
 						pass
 
-				if doupdate:
-					# let's build the mouse report
-					msg[1] += 128 if mousebtn[0] else 0
-					msg[1] += 64 if mousebtn[2] else 0
-					msg[1] += 32 if mseselect else 0
-					msg[1] += 16 if kbselect else 0
-					msg[1] += 8 if not abs_mouse else 0
-					msg[1] += 6 #110
-					msg[2] = mousepos[0]
-					msg[3] = mousepos[1]
-					msg[4] += 128 if mousebtn[1] else 0
-					msg[4] += 2 if Lhandedness else 0
-					msg[4] += 1 if lowspeed else 0
-					# ignore forth byte for now
-					#print(msg)
-					bus.write_block_data(23, 0, msg)
-
-				if all(capture_combo) and not cooldown:
-					if captured:
-						if kbselect:
-							activekb.ungrab()
-						if mseselect:
-							activemse.ungrab()
-						print("Input devices released")
-					else:
-						if kbselect:
-							activekb.grab()
-						if mseselect:
-							activemse.grab()
-						print("Taking control of input devices")
-					captured = not captured
-					cooldown = True
+			now = time.monotonic()
+			if keys or btnchange or (mousedirty and now - lastflush >= flush_interval):
+				# everything from all devices since the last write
+				if abs_mouse:
+					mousepos[0] = min(255, max(0, mousepos[0]+mousedelta[0]))
+					mousepos[1] = min(ntscpal[pal]-1, max(0, mousepos[1]+mousedelta[1]))
+					mousedelta = [0,0]
+				else:
+					# what doesn't fit in a byte goes in the next write
+					mousepos[0] = min(127, max(-128, mousedelta[0]))
+					mousepos[1] = min(127, max(-128, mousedelta[1]))
+					mousedelta = [mousedelta[0]-mousepos[0], mousedelta[1]-mousepos[1]]
+				sendmouse = btnchange or mousedirty
+				mousedirty = any(mousedelta)
+				btnchange = False
+
+				# let's build the mouse report
+				msg = [0,0,0,0,0]
+				msg[1] += 128 if mousebtn[0] else 0
+				msg[1] += 64 if mousebtn[2] else 0
+				msg[1] += 32 if mseselect else 0
+				msg[1] += 16 if kbselect else 0
+				msg[1] += 8 if not abs_mouse else 0
+				msg[1] += 6 #110
+				msg[2] = mousepos[0] & 0xFF
+				msg[3] = mousepos[1] & 0xFF
+				msg[4] += (c_int8(min(7, max(-8, wheel))).value & 0x0F) << 3
+				msg[4] += 128 if mousebtn[1] else 0
+				msg[4] += 2 if Lhandedness else 0
+				msg[4] += 1 if lowspeed else 0
+				wheel = 0
+				# ignore forth byte for now
+				#print(msg)
+				if v2:
+					# as few writes as the keys fit in, the mouse goes
+					# with the last
+					while True:
+						frame = [seq, min(len(keys), v2_max_keys)] + keys[:v2_max_keys]
+						keys = keys[v2_max_keys:]
+						if not keys and sendmouse:
+							frame[1] += v2_mouse
+							frame += msg[1:5]
+						bus.write_block_data(23, v2_page, frame)
+						seq = (seq + 1) & 0xFF
+						if seq == 0:
+							# every 256 writes, tell if the firmware missed any
+							status = bus.read_i2c_block_data(23, v2_page, 6)
+							newgaps = status[2] | (status[3] << 8)
+							newbad = status[4] | (status[5] << 8)
+							if newgaps != gaps or newbad != bad:
+								print("i2c writes lost:", (newgaps - gaps) & 0xFFFF,
+									"malformed:", (newbad - bad) & 0xFFFF)
+							gaps = newgaps
+							bad = newbad
+						if not keys:
+							break
+				else:
+					# one key to a write, relative motion only goes once
+					for keycode in keys or [0]:
+						msg[0] = keycode
+						bus.write_block_data(23, 0, msg)
+						if not abs_mouse:
+							msg[2] = 0
+							msg[3] = 0
+					keys = []
+				lastflush = now
+
+			if all(capture_combo) and not cooldown:
+				if captured:
+					if kbselect:
+						activekb.ungrab()
+					if mseselect:
+						activemse.ungrab()
+					print("Input devices released")
 				else:
-					cooldown = False
+					if kbselect:
+						activekb.grab()
+					if mseselect:
+						activemse.grab()
+					print("Taking control of input devices")
+				captured = not captured
+				cooldown = True
+			elif not all(capture_combo):
+				cooldown = False
 
 	except:
 		print("pico-ps2famikb not found, check config and wiring")
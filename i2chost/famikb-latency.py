@@ -0,0 +1,34 @@
+import struct
+import sys
+from smbus2 import SMBus, i2c_msg
+
+# read back the input latency histograms from a pico-usb2famikb built with
+# LATENCY_STATS, pass "reset" to clear them
+
+# configure i2c bus to use
+i2cbus = 0
+addr = 23
+# LATENCY_PAGE and LATENCY_RESET in pico-usb2famikb.c
+latency_page = 0x80
+latency_reset = 0x81
+
+names = ("keyboard applied", "keyboard strobe", "mouse applied", "mouse strobe")
+
+with SMBus(i2cbus) as bus:
+	if len(sys.argv) > 1 and sys.argv[1] == "reset":
+		bus.write_byte(addr, latency_reset)
+		print("Latency stats cleared on the next strobe")
+		sys.exit(0)
+
+	# count, min, mean, p99, max as little endian uint32 for each
+	write = i2c_msg.write(addr, [latency_page])
+	read = i2c_msg.read(addr, len(names) * 5 * 4)
+	bus.i2c_rdwr(write, read)
+	values = struct.unpack("<%dI" % (len(names) * 5), bytes(list(read)))
+
+	for i, name in enumerate(names):
+		count, lo, mean, p99, hi = values[i*5:i*5+5]
+		if count == 0:
+			print("%-16s no samples" % name)
+		else:
+			print("%-16s n %u  min %u  mean %u  p99 %u  max %u us" % (name, count, lo, mean, p99, hi))
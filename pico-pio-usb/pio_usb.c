@@ -23,6 +23,7 @@
 #include "pio_usb_configuration.h"
 #include "pio_usb_ll.h"
 #include "usb_crc.h"
+#include "usb_tx_encode.h"
 #include "usb_tx.pio.h"
 #include "usb_rx.pio.h"
 
@@ -32,6 +33,7 @@ usb_device_t pio_usb_device[PIO_USB_DEVICE_CNT];
 pio_port_t pio_port[1];
 root_port_t pio_usb_root_port[PIO_USB_ROOT_PORT_CNT];
 endpoint_t pio_usb_ep_pool[PIO_USB_EP_POOL_CNT];
+pio_usb_host_frame_stats_t pio_usb_frame_stats;
 
 static uint8_t ack_encoded[5];
 static uint8_t nak_encoded[5];
@@ -161,6 +163,8 @@ uint8_t __no_inline_not_in_flash_func(pio_usb_bus_wait_handshake)(pio_port_t* pp
     while ((pp->pio_usb_rx->irq & IRQ_RX_COMP_MASK) == 0) {
       continue;
     }
+  } else if (PIO_USB_FRAME_STATS) {
+    pio_usb_frame_stats.timeouts++;
   }
 
  // pio_sm_set_enabled(pp->pio_usb_rx, pp->sm_rx, true);
@@ -210,6 +214,9 @@ int __no_inline_not_in_flash_func(pio_usb_bus_receive_packet_and_handshake)(
         // timing critical end
         return idx - 4;
       }
+      if (PIO_USB_FRAME_STATS && idx >= 4) {
+        pio_usb_frame_stats.crc_errors++;
+      }
     } else {
       // just discard received data since we NAK/STALL anyway
       while ((pp->pio_usb_rx->irq & IRQ_RX_COMP_MASK) == 0) {
@@ -219,6 +226,8 @@ int __no_inline_not_in_flash_func(pio_usb_bus_receive_packet_and_handshake)(
 
       pio_usb_bus_send_handshake(pp, handshake);
     }
+  } else if (PIO_USB_FRAME_STATS) {
+    pio_usb_frame_stats.timeouts++;
   }
 
   return -1;
@@ -331,6 +340,8 @@ void pio_usb_bus_init(pio_port_t *pp, const pio_usb_configuration_t *c,
   root->initialized = true;
   root->dev_addr = 0;
 
+  usb_tx_encode_init();
+
   // pre-encode handshake packets
   uint8_t raw_packet[] = {USB_SYNC, USB_PID_ACK};
   pio_usb_ll_encode_tx_data(raw_packet, 2, ack_encoded);
@@ -396,94 +407,30 @@ void __no_inline_not_in_flash_func(pio_usb_ll_configure_endpoint)(
   ep->ep_num = d->epaddr;
   ep->attr = d->attr;
   ep->interval = d->interval;
-  ep->interval_counter = 0;
   ep->data_id = 0;
 }
 
-// Encode transfer data to 2bit sequence represents TX PIO instruction address
-uint8_t __no_inline_not_in_flash_func(pio_usb_ll_encode_tx_data)(
-    uint8_t const *buffer, uint8_t buffer_len, uint8_t *encoded_data) {
-  uint16_t bit_idx = 0;
-  int current_state = 1;
-  int bit_stuffing = 6;
-  for (int idx = 0; idx < buffer_len; idx++) {
-    uint8_t byte = buffer[idx];
-    for (int b = 0; b < 8; b++) {
-      uint8_t byte_idx = bit_idx >> 2;
-      encoded_data[byte_idx] <<= 2;
-      if (byte & (1 << b)) {
-        if (current_state) {
-          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_K;
-        } else {
-          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_J;
-        }
-        bit_stuffing--;
-      } else {
-        if (current_state) {
-          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_J;
-          current_state = 0;
-        } else {
-          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_K;
-          current_state = 1;
-        }
-        bit_stuffing = 6;
-      }
-
-      bit_idx++;
-
-      if (bit_stuffing == 0) {
-        byte_idx = bit_idx >> 2;
-        encoded_data[byte_idx] <<= 2;
-
-        if (current_state) {
-          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_J;
-          current_state = 0;
-        } else {
-          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_K;
-          current_state = 1;
-        }
-        bit_stuffing = 6;
-        bit_idx++;
-      }
-    }
-  }
-
-  uint8_t byte_idx = bit_idx >> 2;
-  encoded_data[byte_idx] <<= 2;
-  encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_SE0;
-  bit_idx++;
-
-  byte_idx = bit_idx >> 2;
-  encoded_data[byte_idx] <<= 2;
-  encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_COMP;
-  bit_idx++;
-
-  // terminate buffers with K
-  do {
-    byte_idx = bit_idx >> 2;
-    encoded_data[byte_idx] <<= 2;
-    encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_K;
-    bit_idx++;
-  } while (bit_idx & 0x03);
-
-  byte_idx = bit_idx >> 2;
-  return byte_idx;
-}
-
 static inline __force_inline void prepare_tx_data(endpoint_t *ep) {
   uint16_t const xact_len = pio_usb_ll_get_transaction_len(ep);
-  uint8_t buffer[PIO_USB_EP_SIZE + 4];
-  buffer[0] = USB_SYNC;
-  buffer[1] = (ep->data_id == 1) ? USB_PID_DATA1
-                                 : USB_PID_DATA0; // USB_PID_SETUP also DATA0
-  memcpy(buffer + 2, ep->app_buf, xact_len);
-
-  uint16_t const crc16 = calc_usb_crc16(ep->app_buf, xact_len);
-  buffer[2 + xact_len] = crc16 & 0xff;
-  buffer[2 + xact_len + 1] = crc16 >> 8;
-
-  ep->encoded_data_len =
-      pio_usb_ll_encode_tx_data(buffer, xact_len + 4, ep->buffer);
+  uint8_t const *data = ep->app_buf;
+  usb_tx_encoder_t enc;
+  usb_tx_encode_start(&enc, ep->buffer);
+  usb_tx_encode_byte(&enc, USB_SYNC);
+  usb_tx_encode_byte(&enc, (ep->data_id == 1)
+                               ? USB_PID_DATA1
+                               : USB_PID_DATA0); // USB_PID_SETUP also DATA0
+
+  // CRC and encode the payload in one pass, straight from the app buffer
+  uint16_t crc16 = 0xffff;
+  for (uint16_t idx = 0; idx < xact_len; idx++) {
+    crc16 = update_usb_crc16(crc16, data[idx]);
+    usb_tx_encode_byte(&enc, data[idx]);
+  }
+  crc16 ^= 0xffff;
+  usb_tx_encode_byte(&enc, crc16 & 0xff);
+  usb_tx_encode_byte(&enc, crc16 >> 8);
+
+  ep->encoded_data_len = usb_tx_encode_end(&enc, ep->buffer);
 }
 
 bool __no_inline_not_in_flash_func(pio_usb_ll_transfer_start)(endpoint_t *ep,
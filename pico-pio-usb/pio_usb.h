@@ -15,6 +15,10 @@ void pio_usb_host_task(void);
 void pio_usb_host_stop(void);
 void pio_usb_host_restart(void);
 uint32_t pio_usb_host_get_frame_number(void);
+// Copy out the frame stats, and clear them after when reset is true.
+// Only counted with PIO_USB_FRAME_STATS set.
+void pio_usb_host_get_frame_stats(pio_usb_host_frame_stats_t *stats,
+                                  bool reset);
 
 // Call this every 1ms when skip_alarm_pool is true.
 void pio_usb_host_frame(void);
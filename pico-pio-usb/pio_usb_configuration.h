@@ -50,3 +50,9 @@ typedef struct {
 #define PIO_USB_ROOT_PORT_CNT 2
 
 #define PIO_USB_EP_SIZE 64
+
+// Count host frame cycles, NAKs and bus errors for
+// pio_usb_host_get_frame_stats()
+#ifndef PIO_USB_FRAME_STATS
+#define PIO_USB_FRAME_STATS 0
+#endif
@@ -34,6 +34,14 @@ static uint8_t sof_packet[4] = {USB_SYNC, USB_PID_SOF, 0x00, 0x10};
 static uint8_t sof_packet_encoded[4 * 2 * 7 / 6 + 2];
 static uint8_t sof_packet_encoded_len;
 
+// Open endpoints of each root port, and which of them the frame should
+// visit. Interrupt endpoints leave ep_ready after a transaction and wait in
+// a wheel slot for the frame their interval is up, bInterval is at most 255.
+#define EP_WHEEL_SIZE 256
+static uint32_t root_ep_mask[PIO_USB_ROOT_PORT_CNT];
+static uint32_t ep_ready;
+static uint32_t ep_wheel[EP_WHEEL_SIZE];
+
 static bool sof_timer(repeating_timer_t *_rt);
 
 //--------------------------------------------------------------------+
@@ -83,6 +91,14 @@ usb_device_t *pio_usb_host_init(const pio_usb_configuration_t *c) {
   sof_packet_encoded_len =
       pio_usb_ll_encode_tx_data(sof_packet, sizeof(sof_packet), sof_packet_encoded);
 
+  if (PIO_USB_FRAME_STATS) {
+    // Free running SysTick on the processor clock, on the core running frames
+    systick_hw->rvr = 0xffffff;
+    systick_hw->cvr = 0;
+    systick_hw->csr = M0PLUS_SYST_CSR_CLKSOURCE_BITS | M0PLUS_SYST_CSR_ENABLE_BITS;
+    pio_usb_frame_stats.frame_budget = clock_get_hz(clk_sys) / 1000;
+  }
+
   if (!c->skip_alarm_pool) {
     _alarm_pool = c->alarm_pool;
     if (!_alarm_pool) {
@@ -108,6 +124,17 @@ void pio_usb_host_restart(void) {
   }
 }
 
+void pio_usb_host_get_frame_stats(pio_usb_host_frame_stats_t *stats,
+                                  bool reset) {
+  uint32_t const status = save_and_disable_interrupts();
+  *stats = pio_usb_frame_stats;
+  if (reset) {
+    memset(&pio_usb_frame_stats, 0, sizeof(pio_usb_frame_stats));
+    pio_usb_frame_stats.frame_budget = stats->frame_budget;
+  }
+  restore_interrupts(status);
+}
+
 //--------------------------------------------------------------------+
 // Bus functions
 //--------------------------------------------------------------------+
@@ -225,9 +252,11 @@ static bool __no_inline_not_in_flash_func(connection_check)(root_port_t *port) {
 
       // failed/retired all queuing transfer in this root
       uint8_t root_idx = port - PIO_USB_ROOT_PORT(0);
-      for (int ep_idx = 0; ep_idx < PIO_USB_EP_POOL_CNT; ep_idx++) {
-        endpoint_t *ep = PIO_USB_ENDPOINT(ep_idx);
-        if ((ep->root_idx == root_idx) && ep->size && ep->has_transfer) {
+      uint32_t ep_mask = root_ep_mask[root_idx];
+      while (ep_mask) {
+        endpoint_t *ep = PIO_USB_ENDPOINT(__builtin_ctz(ep_mask));
+        ep_mask &= ep_mask - 1;
+        if (ep->has_transfer) {
           pio_usb_ll_transfer_complete(ep, PIO_USB_INTS_ENDPOINT_ERROR_BITS);
         }
       }
@@ -251,6 +280,7 @@ void __not_in_flash_func(pio_usb_host_frame)(void) {
     return;
   }
 
+  uint32_t const frame_start = pio_usb_ll_stats_start();
   pio_port_t *pp = PIO_USB_PIO_PORT(0);
 
   // Send SOF
@@ -260,10 +290,17 @@ void __not_in_flash_func(pio_usb_host_frame)(void) {
           connection_check(root))) {
       continue;
     }
+    uint32_t const sof_start = pio_usb_ll_stats_start();
     configure_root_port(pp, root);
     pio_usb_bus_usb_transfer(pp, sof_packet_encoded, sof_packet_encoded_len);
+    pio_usb_ll_stats_time(&pio_usb_frame_stats.sof, sof_start);
   }
 
+  // Interrupt endpoints whose interval is up this frame
+  uint32_t const slot = sof_count & (EP_WHEEL_SIZE - 1);
+  ep_ready |= ep_wheel[slot];
+  ep_wheel[slot] = 0;
+
   // Carry out all queued endpoint transaction
   for (int root_idx = 0; root_idx < PIO_USB_ROOT_PORT_CNT; root_idx++) {
     root_port_t *root = PIO_USB_ROOT_PORT(root_idx);
@@ -273,45 +310,47 @@ void __not_in_flash_func(pio_usb_host_frame)(void) {
 
     configure_root_port(pp, root);
 
-    for (int ep_pool_idx = 0; ep_pool_idx < PIO_USB_EP_POOL_CNT;
-         ep_pool_idx++) {
+    uint32_t ep_mask = root_ep_mask[root_idx] & ep_ready;
+    while (ep_mask) {
+      int const ep_pool_idx = __builtin_ctz(ep_mask);
+      ep_mask &= ep_mask - 1;
       endpoint_t *ep = PIO_USB_ENDPOINT(ep_pool_idx);
-      if ((ep->root_idx == root_idx) && ep->size) {
-        bool const is_periodic = ((ep->attr & 0x03) == EP_ATTR_INTERRUPT);
+      bool const is_periodic = ((ep->attr & 0x03) == EP_ATTR_INTERRUPT);
 
-        if (is_periodic && (ep->interval_counter > 0)) {
-          ep->interval_counter--;
-          continue;
-        }
-
-        if (ep->has_transfer && !ep->transfer_aborted) {
-          ep->transfer_started = true;
+      if (ep->has_transfer && !ep->transfer_aborted) {
+        ep->transfer_started = true;
 
-          if (ep->need_pre) {
-            pp->need_pre = true;
-          }
+        if (ep->need_pre) {
+          pp->need_pre = true;
+        }
 
-          if (ep->ep_num == 0 && ep->data_id == USB_PID_SETUP) {
-            usb_setup_transaction(pp, ep);
+        uint32_t const xact_start = pio_usb_ll_stats_start();
+        if (ep->ep_num == 0 && ep->data_id == USB_PID_SETUP) {
+          usb_setup_transaction(pp, ep);
+          pio_usb_ll_stats_time(&pio_usb_frame_stats.setup, xact_start);
+        } else {
+          if (ep->ep_num & EP_IN) {
+            usb_in_transaction(pp, ep);
+            pio_usb_ll_stats_time(&pio_usb_frame_stats.in, xact_start);
           } else {
-            if (ep->ep_num & EP_IN) {
-              usb_in_transaction(pp, ep);
-            } else {
-              usb_out_transaction(pp, ep);
-            }
-
-            if (is_periodic) {
-              ep->interval_counter = ep->interval - 1;
-            }
+            usb_out_transaction(pp, ep);
+            pio_usb_ll_stats_time(&pio_usb_frame_stats.out, xact_start);
           }
 
-          if (ep->need_pre) {
-            pp->need_pre = false;
-            restore_fs_bus(pp);
+          if (is_periodic) {
+            // back bInterval frames from now, 256 for a bogus 0 as before
+            ep_ready &= ~(1u << ep_pool_idx);
+            ep_wheel[(sof_count + ep->interval) & (EP_WHEEL_SIZE - 1)] |=
+                1u << ep_pool_idx;
           }
+        }
 
-          ep->transfer_started = false;
+        if (ep->need_pre) {
+          pp->need_pre = false;
+          restore_fs_bus(pp);
         }
+
+        ep->transfer_started = false;
       }
     }
   }
@@ -345,6 +384,12 @@ void __not_in_flash_func(pio_usb_host_frame)(void) {
   sof_packet[3] = (calc_usb_crc5(sof_count_11b) << 3) | (sof_count_11b >> 8);
   sof_packet_encoded_len =
       pio_usb_ll_encode_tx_data(sof_packet, sizeof(sof_packet), sof_packet_encoded);
+
+  if (PIO_USB_FRAME_STATS &&
+      pio_usb_ll_stats_time(&pio_usb_frame_stats.frame, frame_start) >
+          pio_usb_frame_stats.frame_budget) {
+    pio_usb_frame_stats.overruns++;
+  }
 }
 
 static bool __no_inline_not_in_flash_func(sof_timer)(repeating_timer_t *_rt) {
@@ -390,11 +435,33 @@ void pio_usb_host_port_reset_end(uint8_t root_idx) {
   root->suspended = false;
 }
 
+// Let the frame visit an endpoint, right away even if it is periodic
+static void endpoint_activate(endpoint_t *ep) {
+  uint32_t const ep_bit = 1u << (ep - pio_usb_ep_pool);
+  uint32_t const status = save_and_disable_interrupts();
+  root_ep_mask[ep->root_idx] |= ep_bit;
+  ep_ready |= ep_bit;
+  restore_interrupts(status);
+}
+
+static void endpoint_deactivate(endpoint_t *ep) {
+  uint32_t const ep_bit = 1u << (ep - pio_usb_ep_pool);
+  uint32_t const status = save_and_disable_interrupts();
+  root_ep_mask[ep->root_idx] &= ~ep_bit;
+  ep_ready &= ~ep_bit;
+  for (int slot = 0; slot < EP_WHEEL_SIZE; slot++) {
+    ep_wheel[slot] &= ~ep_bit;
+  }
+  restore_interrupts(status);
+}
+
 void pio_usb_host_close_device(uint8_t root_idx, uint8_t device_address) {
-  for (int ep_pool_idx = 0; ep_pool_idx < PIO_USB_EP_POOL_CNT; ep_pool_idx++) {
-    endpoint_t *ep = PIO_USB_ENDPOINT(ep_pool_idx);
-    if ((ep->root_idx == root_idx) && (ep->dev_addr == device_address) &&
-        ep->size) {
+  uint32_t ep_mask = root_ep_mask[root_idx];
+  while (ep_mask) {
+    endpoint_t *ep = PIO_USB_ENDPOINT(__builtin_ctz(ep_mask));
+    ep_mask &= ep_mask - 1;
+    if (ep->dev_addr == device_address) {
+      endpoint_deactivate(ep);
       ep->size = 0;
       ep->has_transfer = false;
     }
@@ -417,6 +484,20 @@ static inline __force_inline endpoint_t * _find_ep(uint8_t root_idx,
   return NULL;
 }
 
+// Device pool index owning an address, looked up once when an endpoint opens
+// so that completions don't have to search for it
+static uint8_t device_index(uint8_t root_idx, uint8_t device_address) {
+  for (int idx = 0; idx < PIO_USB_DEVICE_CNT; idx++) {
+    usb_device_t *dev = &pio_usb_device[idx];
+    if (dev->connected && dev->root == PIO_USB_ROOT_PORT(root_idx) &&
+        dev->address == device_address) {
+      return idx;
+    }
+  }
+
+  return PIO_USB_DEVICE_CNT;
+}
+
 bool pio_usb_host_endpoint_open(uint8_t root_idx, uint8_t device_address,
                                 uint8_t const *desc_endpoint, bool need_pre) {
   const endpoint_descriptor_t *d = (const endpoint_descriptor_t *)desc_endpoint;
@@ -427,8 +508,10 @@ bool pio_usb_host_endpoint_open(uint8_t root_idx, uint8_t device_address,
       pio_usb_ll_configure_endpoint(ep, desc_endpoint);
       ep->root_idx = root_idx;
       ep->dev_addr = device_address;
+      ep->dev_idx = device_index(root_idx, device_address);
       ep->need_pre = need_pre;
       ep->is_tx = (d->epaddr & 0x80) ? false : true; // host endpoint out is tx
+      endpoint_activate(ep);
       return true;
     }
   }
@@ -528,6 +611,9 @@ static int __no_inline_not_in_flash_func(usb_in_transaction)(pio_port_t *pp,
     }
   } else if (receive_pid == USB_PID_NAK) {
     // NAK try again next frame
+    if (PIO_USB_FRAME_STATS) {
+      pio_usb_frame_stats.naks++;
+    }
   } else if (receive_pid == USB_PID_STALL) {
     pio_usb_ll_transfer_complete(ep, PIO_USB_INTS_ENDPOINT_STALLED_BITS);
   } else {
@@ -566,6 +652,9 @@ static int __no_inline_not_in_flash_func(usb_out_transaction)(pio_port_t *pp,
     pio_usb_ll_transfer_continue(ep, xact_len);
   } else if (receive_token == USB_PID_NAK) {
     // NAK try again next frame
+    if (PIO_USB_FRAME_STATS) {
+      pio_usb_frame_stats.naks++;
+    }
   } else if (receive_token == USB_PID_STALL) {
     pio_usb_ll_transfer_complete(ep, PIO_USB_INTS_ENDPOINT_STALLED_BITS);
   } else {
@@ -993,15 +1082,16 @@ static int enumerate_device(usb_device_t *device, uint8_t address) {
 
           if (ep != NULL) {
             ep->interval = d->interval;
-            ep->interval_counter = 0;
             ep->size = d->max_size[0] | (d->max_size[1] << 8);
             ep->attr = d->attr | EP_ATTR_ENUMERATING;
             ep->ep_num = d->epaddr;
 
             ep->root_idx = device->root - pio_usb_root_port;
             ep->dev_addr = device->address;
+            ep->dev_idx = device - pio_usb_device;
             ep->need_pre = !device->is_root && !device->is_fullspeed;
             ep->is_tx = (d->epaddr & 0x80) ? false : true;
+            endpoint_activate((endpoint_t *)ep);
           } else {
             printf("No empty EP\n");
           }
@@ -1076,6 +1166,8 @@ static void device_disconnect(usb_device_t *device) {
     if (ep == NULL) {
       break;
     }
+    // out of the root mask and the wheel before the slot can be reused
+    endpoint_deactivate(ep);
     memset(ep, 0, sizeof(*ep));
   }
 
@@ -1261,72 +1353,67 @@ static void __no_inline_not_in_flash_func(handle_endpoint_irq)(
   (void)root;
   const uint32_t ep_all = *ep_reg;
 
-  for (uint8_t ep_idx = 0; ep_idx < PIO_USB_EP_POOL_CNT; ep_idx++) {
-    if (ep_all & (1u << ep_idx)) {
-      endpoint_t *ep = PIO_USB_ENDPOINT(ep_idx);
-      usb_device_t *device = NULL;
-
-      // find device this endpoint belongs to
-      for (int idx = 0; idx < PIO_USB_DEVICE_CNT; idx++) {
-        usb_device_t *dev = &pio_usb_device[idx];
-        if (dev->connected && (ep->dev_addr == dev->address)) {
-          device = dev;
-          break;
-        }
-      }
+  uint32_t ep_mask = ep_all;
+  while (ep_mask) {
+    endpoint_t *ep = PIO_USB_ENDPOINT(__builtin_ctz(ep_mask));
+    ep_mask &= ep_mask - 1;
+    usb_device_t *device = NULL;
+    if (ep->dev_idx < PIO_USB_DEVICE_CNT &&
+        pio_usb_device[ep->dev_idx].connected) {
+      device = &pio_usb_device[ep->dev_idx];
+    }
 
-      if (device) {
-        // control endpoint is either 0x00 or 0x80
-        if ((ep->ep_num & 0x7f) == 0) {
-          control_pipe_t *pipe = &device->control_pipe;
+    if (device) {
+      // control endpoint is either 0x00 or 0x80
+      if ((ep->ep_num & 0x7f) == 0) {
+        control_pipe_t *pipe = &device->control_pipe;
 
-          if (flag != PIO_USB_INTS_ENDPOINT_COMPLETE_BITS) {
-            pipe->stage = STAGE_SETUP;
-            pipe->operation = CONTROL_ERROR;
-          } else {
-            ep->data_id = 1; // both data and status have DATA1
-            if (pipe->stage == STAGE_SETUP) {
-              if (pipe->operation == CONTROL_IN) {
-                pipe->stage = STAGE_IN;
+        if (flag != PIO_USB_INTS_ENDPOINT_COMPLETE_BITS) {
+          pipe->stage = STAGE_SETUP;
+          pipe->operation = CONTROL_ERROR;
+        } else {
+          ep->data_id = 1; // both data and status have DATA1
+          if (pipe->stage == STAGE_SETUP) {
+            if (pipe->operation == CONTROL_IN) {
+              pipe->stage = STAGE_IN;
+              ep->ep_num = 0x80;
+              ep->is_tx = false;
+              pio_usb_ll_transfer_start(ep,
+                                        (uint8_t *)(uintptr_t)pipe->rx_buffer,
+                                        pipe->request_length);
+            } else if (pipe->operation == CONTROL_OUT) {
+              if (pipe->out_data_packet.tx_address != NULL) {
+                pipe->stage = STAGE_OUT;
+                ep->ep_num = 0x00;
+                ep->is_tx = true;
+                pio_usb_ll_transfer_start(ep,
+                                          pipe->out_data_packet.tx_address,
+                                          pipe->out_data_packet.tx_length);
+              } else {
+                pipe->stage = STAGE_STATUS;
                 ep->ep_num = 0x80;
                 ep->is_tx = false;
-                pio_usb_ll_transfer_start(ep,
-                                          (uint8_t *)(uintptr_t)pipe->rx_buffer,
-                                          pipe->request_length);
-              } else if (pipe->operation == CONTROL_OUT) {
-                if (pipe->out_data_packet.tx_address != NULL) {
-                  pipe->stage = STAGE_OUT;
-                  ep->ep_num = 0x00;
-                  ep->is_tx = true;
-                  pio_usb_ll_transfer_start(ep,
-                                            pipe->out_data_packet.tx_address,
-                                            pipe->out_data_packet.tx_length);
-                } else {
-                  pipe->stage = STAGE_STATUS;
-                  ep->ep_num = 0x80;
-                  ep->is_tx = false;
-                  pio_usb_ll_transfer_start(ep, NULL, 0);
-                }
+                pio_usb_ll_transfer_start(ep, NULL, 0);
               }
-            } else if (pipe->stage == STAGE_IN) {
-              pipe->stage = STAGE_STATUS;
-              ep->ep_num = 0x00;
-              ep->is_tx = true;
-              pio_usb_ll_transfer_start(ep, NULL, 0);
-            } else if (pipe->stage == STAGE_OUT) {
-              pipe->stage = STAGE_STATUS;
-              ep->ep_num = 0x80;
-              ep->is_tx = false;
-              pio_usb_ll_transfer_start(ep, NULL, 0);
-            } else if (pipe->stage == STAGE_STATUS) {
-              pipe->stage = STAGE_SETUP;
-              pipe->operation = CONTROL_COMPLETE;
             }
+          } else if (pipe->stage == STAGE_IN) {
+            pipe->stage = STAGE_STATUS;
+            ep->ep_num = 0x00;
+            ep->is_tx = true;
+            pio_usb_ll_transfer_start(ep, NULL, 0);
+          } else if (pipe->stage == STAGE_OUT) {
+            pipe->stage = STAGE_STATUS;
+            ep->ep_num = 0x80;
+            ep->is_tx = false;
+            pio_usb_ll_transfer_start(ep, NULL, 0);
+          } else if (pipe->stage == STAGE_STATUS) {
+            pipe->stage = STAGE_SETUP;
+            pipe->operation = CONTROL_COMPLETE;
           }
-        } else if (device->device_class == CLASS_HUB && (ep->ep_num & EP_IN)) {
-          // hub interrupt endpoint
-          device->event = EVENT_HUB_PORT_CHANGE;
         }
+      } else if (device->device_class == CLASS_HUB && (ep->ep_num & EP_IN)) {
+        // hub interrupt endpoint
+        device->event = EVENT_HUB_PORT_CHANGE;
       }
     }
   }
@@ -6,6 +6,7 @@
 #pragma once
 
 #include "hardware/pio.h"
+#include "hardware/structs/systick.h"
 #include "pio_usb_configuration.h"
 #include "usb_definitions.h"
 #include <stdint.h>
@@ -160,14 +161,29 @@ pio_usb_ll_get_transaction_len(endpoint_t *ep) {
   return (remaining < ep->size) ? remaining : ep->size;
 }
 
-enum {
-  PIO_USB_TX_ENCODED_DATA_SE0 = 0,
-  PIO_USB_TX_ENCODED_DATA_K = 1,
-  PIO_USB_TX_ENCODED_DATA_COMP = 2,
-  PIO_USB_TX_ENCODED_DATA_J = 3,
-};
-uint8_t pio_usb_ll_encode_tx_data(uint8_t const *buffer, uint8_t buffer_len,
-                                  uint8_t *encoded_data);
+#include "usb_tx_encode.h"
+
+extern pio_usb_host_frame_stats_t pio_usb_frame_stats;
+
+// SysTick counts core clock cycles down from 0xffffff, it is enabled by
+// pio_usb_host_init() when PIO_USB_FRAME_STATS is set
+static inline __force_inline uint32_t pio_usb_ll_stats_start(void) {
+  return PIO_USB_FRAME_STATS ? systick_hw->cvr : 0;
+}
+
+static inline __force_inline uint32_t
+pio_usb_ll_stats_time(pio_usb_timing_t *timing, uint32_t start) {
+  if (!PIO_USB_FRAME_STATS) {
+    return 0;
+  }
+  uint32_t const cycles = (start - systick_hw->cvr) & 0xffffff;
+  timing->count++;
+  timing->cycles_total += cycles;
+  if (cycles > timing->cycles_max) {
+    timing->cycles_max = cycles;
+  }
+  return cycles;
+}
 
 //--------------------------------------------------------------------
 // Host Controller functions
@@ -56,6 +56,7 @@ typedef struct {
 typedef struct {
   volatile uint8_t root_idx;
   volatile uint8_t dev_addr;
+  uint8_t dev_idx; // owner in pio_usb_device[], PIO_USB_DEVICE_CNT if none
   bool need_pre;
   bool is_tx; // Host out or Device in
 
@@ -65,7 +66,6 @@ typedef struct {
 
   volatile uint8_t attr;
   volatile uint8_t interval;
-  volatile uint8_t interval_counter;
   volatile uint8_t data_id; // data0 or data1
 
   volatile bool stalled;
@@ -344,3 +344,24 @@ typedef struct {
   const uint8_t **hid_report;
   const string_descriptor_t *string;
 } usb_descriptor_buffers_t;
+
+typedef struct {
+  uint32_t count;
+  uint32_t cycles_total;
+  uint32_t cycles_max;
+} pio_usb_timing_t;
+
+// Host frame timing in core clock cycles since the last reset. All fields
+// are uint32_t so that the struct can be sent as is.
+typedef struct {
+  uint32_t frame_budget;  // cycles in one 1ms frame
+  pio_usb_timing_t frame; // pio_usb_host_frame() from start to end
+  pio_usb_timing_t sof;
+  pio_usb_timing_t setup;
+  pio_usb_timing_t in;
+  pio_usb_timing_t out;
+  uint32_t naks;
+  uint32_t crc_errors;
+  uint32_t timeouts;      // no packet or handshake came back
+  uint32_t overruns;      // frames longer than frame_budget
+} pio_usb_host_frame_stats_t;
@@ -0,0 +1,81 @@
+#pragma GCC push_options
+#pragma GCC optimize("-O3")
+
+#include "usb_tx_encode.h"
+
+// Place to RAM, read once per byte sent
+uint32_t __not_in_flash("encode_tbl") usb_tx_encode_tbl[6][256];
+
+void usb_tx_encode_init(void) {
+  for (uint32_t run = 0; run < 6; run++) {
+    for (uint32_t byte = 0; byte < 256; byte++) {
+      uint32_t symbols = 0;
+      uint32_t bits = 0;
+      uint32_t ones = run;
+      int current_state = 1;
+      for (int b = 0; b < 8; b++) {
+        symbols <<= 2;
+        if (byte & (1 << b)) {
+          symbols |= current_state ? PIO_USB_TX_ENCODED_DATA_K
+                                   : PIO_USB_TX_ENCODED_DATA_J;
+          ones++;
+        } else {
+          symbols |= current_state ? PIO_USB_TX_ENCODED_DATA_J
+                                   : PIO_USB_TX_ENCODED_DATA_K;
+          current_state = !current_state;
+          ones = 0;
+        }
+        bits += 2;
+
+        if (ones == 6) {
+          symbols <<= 2;
+          symbols |= current_state ? PIO_USB_TX_ENCODED_DATA_J
+                                   : PIO_USB_TX_ENCODED_DATA_K;
+          current_state = !current_state;
+          ones = 0;
+          bits += 2;
+        }
+      }
+      usb_tx_encode_tbl[run][byte] =
+          symbols | (bits << USB_TX_ENCODE_BITS_POS) |
+          (ones << USB_TX_ENCODE_RUN_POS) |
+          ((uint32_t)!current_state << USB_TX_ENCODE_FLIP_POS);
+    }
+  }
+}
+
+uint8_t __no_inline_not_in_flash_func(usb_tx_encode_end)(
+    usb_tx_encoder_t *enc, uint8_t *encoded_data) {
+  uint32_t acc = enc->acc;
+  uint32_t bits = enc->bits;
+
+  acc = (acc << 2) | PIO_USB_TX_ENCODED_DATA_SE0;
+  acc = (acc << 2) | PIO_USB_TX_ENCODED_DATA_COMP;
+  bits += 4;
+
+  // terminate buffers with K
+  do {
+    acc = (acc << 2) | PIO_USB_TX_ENCODED_DATA_K;
+    bits += 2;
+  } while (bits & 0x07);
+
+  while (bits) {
+    bits -= 8;
+    *enc->out++ = acc >> bits;
+  }
+
+  return enc->out - encoded_data;
+}
+
+// Encode transfer data to 2bit sequence represents TX PIO instruction address
+uint8_t __no_inline_not_in_flash_func(pio_usb_ll_encode_tx_data)(
+    uint8_t const *buffer, uint8_t buffer_len, uint8_t *encoded_data) {
+  usb_tx_encoder_t enc;
+  usb_tx_encode_start(&enc, encoded_data);
+  for (int idx = 0; idx < buffer_len; idx++) {
+    usb_tx_encode_byte(&enc, buffer[idx]);
+  }
+  return usb_tx_encode_end(&enc, encoded_data);
+}
+
+#pragma GCC pop_options
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+#include "pico/stdlib.h"
+
+enum {
+  PIO_USB_TX_ENCODED_DATA_SE0 = 0,
+  PIO_USB_TX_ENCODED_DATA_K = 1,
+  PIO_USB_TX_ENCODED_DATA_COMP = 2,
+  PIO_USB_TX_ENCODED_DATA_J = 3,
+};
+
+// NRZI and bit stuffing a byte at a time. An entry of usb_tx_encode_tbl is
+// indexed by the 1s already sent in a row and the next byte, for a line
+// that is in K before it. It holds that byte's tx symbols, first one in the
+// highest bits, how many bits of symbols there are, the new run of 1s and
+// whether the line ends up in J. Starting in J is the same with every
+// symbol's J/K swapped.
+#define USB_TX_ENCODE_SYMBOLS_MASK 0xfffffu
+#define USB_TX_ENCODE_BITS_POS 20
+#define USB_TX_ENCODE_RUN_POS 25
+#define USB_TX_ENCODE_FLIP_POS 28
+#define USB_TX_ENCODE_SWAP 0xaaaaau
+
+extern uint32_t usb_tx_encode_tbl[6][256];
+
+typedef struct {
+  uint32_t acc;   // symbols not stored yet, oldest in the highest bits
+  uint32_t bits;  // bits of acc still to store, less than 8
+  uint32_t run;   // 1s sent in a row
+  uint32_t swap;  // USB_TX_ENCODE_SWAP while the line is in J, else 0
+  uint8_t *out;
+} usb_tx_encoder_t;
+
+// build usb_tx_encode_tbl, before the first packet is encoded
+void usb_tx_encode_init(void);
+
+static inline __force_inline void usb_tx_encode_start(usb_tx_encoder_t *enc,
+                                                      uint8_t *out) {
+  enc->acc = 0;
+  enc->bits = 0;
+  enc->run = 0;
+  enc->swap = 0;
+  enc->out = out;
+}
+
+static inline __force_inline void usb_tx_encode_byte(usb_tx_encoder_t *enc,
+                                                     uint8_t byte) {
+  uint32_t e = usb_tx_encode_tbl[enc->run][byte];
+  uint32_t n = (e >> USB_TX_ENCODE_BITS_POS) & 0x1f;
+  enc->acc = (enc->acc << n) | ((e ^ enc->swap) & ((1u << n) - 1));
+  enc->bits += n;
+  while (enc->bits >= 8) {
+    enc->bits -= 8;
+    *enc->out++ = enc->acc >> enc->bits;
+  }
+  enc->run = (e >> USB_TX_ENCODE_RUN_POS) & 0x7;
+  enc->swap ^= -((e >> USB_TX_ENCODE_FLIP_POS) & 1) & USB_TX_ENCODE_SWAP;
+}
+
+// EOP and K up to the end of the last byte, returns the encoded length
+uint8_t usb_tx_encode_end(usb_tx_encoder_t *enc, uint8_t *encoded_data);
+
+uint8_t pio_usb_ll_encode_tx_data(uint8_t const *buffer, uint8_t buffer_len,
+                                  uint8_t *encoded_data);
@@ -12,7 +12,6 @@
 #include <stdio.h>
 #include <string.h>
 #include <hardware/i2c.h>
-#include <pico/i2c_slave.h>
 
 #include "pico/bootrom.h"
 #include "pico/stdlib.h"
@@ -21,6 +20,8 @@
 #include "hardware/gpio.h"
 #include "hardware/pio.h"
 #include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
 
 #ifdef CYW43_WL_GPIO_LED_PIN
 #include "pico/cyw43_arch.h"
@@ -31,6 +32,7 @@
 
 #include "neskbdinter.h"
 #include "usb2famikb.h"
+#include "hid-report.h"
 
 // unnecessary now?
 //#include "kblayout.c"
@@ -55,14 +57,52 @@
 #define i2cHOST_ENABLE 28
 
 
+// serialized mode key FIFO depth, a power of two no bigger than 128
 #define MAX_BUFFER 16
 #define WORD_SIZE 4
+_Static_assert((MAX_BUFFER & (MAX_BUFFER - 1)) == 0 && MAX_BUFFER <= 128,
+    "MAX_BUFFER must be a power of two up to 128");
 
 // extra config for devices in direct input mode
 #define MSERELATIVE 1
 #define HORILHAND 1
 #define HORILOWSPD 0
 #define SENDREPEATS 1
+// typematic delay and rate for SENDREPEATS in keyboard mouse host mode
+#define REPEAT_DELAY_MS 500
+#define REPEAT_RATE_MS 33
+// relative mouse motion a strobe can't carry is sent with the following
+// ones, up to this many strobes' worth
+#define MSECARRY 4
+
+// only rebuild and push the $4017 word when something it depends on moved
+#ifndef INCREMENTAL_OUTPUT
+#define INCREMENTAL_OUTPUT 1
+#endif
+// answer family basic reads with PIO+DMA from keymatrix, core1 only steps
+// in on the strobe
+#ifndef DMA_OUTPUT
+#define DMA_OUTPUT 0
+#endif
+// let core1 sleep between $4016 edges and $4017 reads instead of polling
+#ifndef SLEEP_CORE1
+#define SLEEP_CORE1 0
+#endif
+// time every input event from core0 accepting it to the NES strobe that
+// sees it, readable over I2C
+#ifndef LATENCY_STATS
+#define LATENCY_STATS 0
+#endif
+// keep a timestamped log of the keyboard, mouse and i2c host input core0
+// takes in, readable over I2C with i2chost/famikb-capture.py
+#ifndef INPUT_CAPTURE
+#define INPUT_CAPTURE 0
+#endif
+// play input-replay.h, a capture turned into C by famikb-capture.py, back
+// through the same paths with its original timing, starting at boot
+#ifndef INPUT_REPLAY
+#define INPUT_REPLAY 0
+#endif
 
 
 // configuration for PIO USB
@@ -81,21 +121,11 @@
 
 
 // keypress matrix for family basic mode & suborkb
-static bool keymatrix[] = {
-    0, 0, 0, 0, 0, 0, 0, 0, // 0 0, 0 1
-    0, 0, 0, 0, 0, 0, 0, 0, // 1 0, 1 1
-    0, 0, 0, 0, 0, 0, 0, 0, // 2 0, 2 1
-    0, 0, 0, 0, 0, 0, 0, 0, // 3 0, 3 1
-    0, 0, 0, 0, 0, 0, 0, 0, // 4 0, 4 1
-    0, 0, 0, 0, 0, 0, 0, 0, // 5 0, 5 1
-    0, 0, 0, 0, 0, 0, 0, 0, // 6 0, 6 1
-    0, 0, 0, 0, 0, 0, 0, 0, // 7 0, 7 1
-    0, 0, 0, 0, 0, 0, 0, 0, // 8 0, 8 1 famikb stops here
-    0, 0, 0, 0, 0, 0, 0, 0, // 9 0, 9 1
-    0, 0, 0, 0, 0, 0, 0, 0, // 10 0, 10 1
-    0, 0, 0, 0, 0, 0, 0, 0, // 11 0, 11 1
-    0, 0, 0, 0, 0, 0, 0, 0  // 12 0, 12 1
-};
+// one entry per select block, already laid out as the four data bits on
+// D1-D4 so core1 can put a block on $4017 with a single load
+// famikb uses the first 18 blocks, subor all 26
+#define MATRIX_BLOCKS 26
+static uint8_t keymatrix[MATRIX_BLOCKS];
 static const uint8_t famikey[] = {
     KEY_RIGHTBRACE, KEY_LEFTBRACE, KEY_ENTER, KEY_F8, 
     KEY_F12, KEY_BACKSLASH, KEY_RIGHTSHIFT, KEY_RIGHTALT,
@@ -144,6 +174,12 @@ static const uint8_t suborkey[] = {
     KEY_SPACE, KEY_PAUSE, KEY_KP6, KEY_GRAVE,
     KEY_KP0, KEY_KPDOT, KEY_KP3, KEY_F9 
 };
+// keycode to matrix index for the current mode, built once at boot so a
+// key event is a single lookup instead of a scan of famikey/suborkey
+#define NO_MATRIX_KEY 0xFF
+static uint8_t keyindex[128];
+// subor has a few keys that sit in two cells, the second cell lives here
+static uint8_t keyindex2[128];
 static const uint8_t modkeys[] = { 
     KEY_LEFTCTRL, KEY_LEFTSHIFT, KEY_LEFTALT, KEY_LEFTMETA,
     KEY_RIGHTCTRL, KEY_RIGHTSHIFT, KEY_RIGHTALT, KEY_RIGHTMETA
@@ -156,19 +192,154 @@ static struct
     uint8_t mem[6];
     uint8_t mem_address;
     bool mem_address_written;
+    bool data_written;      // anything after the page byte
     bool garbage_message;
 } hostmsg;
 
+// v2 framing, a whole batch of events in one write to I2C_V2_PAGE. after
+// the SMBus length byte: a sequence number, the key count with bit 7 set
+// when a mouse report follows, the keycodes and then the mouse bytes 2-5
+// of the v1 layout. reading the page back gives the next sequence number
+// expected, the version, and the gaps and bad frames seen as uint16s
+#define I2C_V2_PAGE 0x20
+#define I2C_V2_VERSION 2
+#define I2C_V2_MAX 32
+#define I2C_V2_MOUSE 0x80
+static struct
+{
+    uint8_t buf[I2C_V2_MAX + 1];    // SMBus length byte first
+    uint8_t len;
+    uint8_t seq;
+    uint16_t gaps;      // frames the sequence numbers skipped over
+    uint16_t bad;       // frames that didn't add up, dropped whole
+    uint8_t status[6];
+    uint8_t statusindex;
+} hostv2;
+
+// finished host writes, the I2C ISR queues them and core0's main loop
+// decodes them into input events. single producer/single consumer like the
+// input queue, both ends on core0
+#define I2C_RX_RING 8
+typedef struct
+{
+    uint8_t page;
+    uint8_t len;
+    uint8_t buf[I2C_V2_MAX + 1];
+} i2c_rx_msg_t;
+static i2c_rx_msg_t i2crx[I2C_RX_RING];
+static volatile uint8_t i2crxhead = 0;
+static volatile uint8_t i2crxtail = 0;
+static uint32_t i2crx_dropped = 0;
+
 static bool new_input_msg;
 // FIFO buffer for keypresses for standard mode
 // buffer length will be relatively small because under standard operation
 // the NES is likely to be reading from the buffer very frequently
-static uint8_t bufferindex = 0;
+// it is a ring, keycode_handler moves keyhead and the strobe moves keytail,
+// both run freely and wrap at 256
 static uint8_t keybuffer[MAX_BUFFER];
-static uint8_t kbbbindex = 0;
-static uint8_t kbbackbuffer[MAX_BUFFER];
-// transport buffer index
-static uint8_t transbbindex = 0;
+static uint8_t keyhead = 0;
+static uint8_t keytail = 0;
+// keys that arrived with the ring full
+static uint32_t keydrops = 0;
+
+// input events from core0 (USB callbacks or the I2C ISR) to core1
+// single producer/single consumer, core0 only moves inputhead and core1 only
+// moves inputtail. core1 applies everything queued at the start of a strobe
+// so the NES never sees half of an update in the middle of a read
+#define INPUT_QUEUE 64
+static uint32_t inputqueue[INPUT_QUEUE];
+static volatile uint8_t inputhead = 0;
+static volatile uint8_t inputtail = 0;
+static uint32_t input_queued = 0;
+static uint32_t input_dropped = 0;
+static uint32_t input_applied = 0;
+
+// event type in the top byte, two payload bytes at the bottom
+#define INPUT_KEY 1      // keycode, bit 7 set for release
+#define INPUT_STATE 2    // mouse status bytes 0 and 3, read on the next strobe
+#define INPUT_BUTTONS 3  // as above, but also held until the NES has seen them
+#define INPUT_MOVE 4     // mouse x, y
+#define INPUT_EVENT(type, hi, lo) \
+    (((uint32_t)(type) << 24) | ((uint32_t)(uint8_t)(hi) << 8) | (uint8_t)(lo))
+
+// input latency histograms, per device and per stage, all in microseconds
+// core0 stamps every event as it is queued, core1 records when it was
+// applied and again at the first strobe after that
+#define LAT_KEYBOARD 0
+#define LAT_MOUSE 1
+#define LAT_DEVICES 2
+#define LAT_APPLIED 0   // queued -> in keymatrix/keybuffer/msebuffer
+#define LAT_STROBE 1    // queued -> first strobe that can see it
+#define LAT_STAGES 2
+#define LAT_NONE 0xFF
+// 512us buckets, the last one also takes everything past 32ms
+#define LATENCY_BUCKETS 64
+#define LATENCY_BUCKET_SHIFT 9
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint16_t buckets[LATENCY_BUCKETS];
+} latency_hist_t;
+static latency_hist_t latency[LAT_DEVICES][LAT_STAGES];
+// odd while core1 is changing the histograms, core0 reads them again if it
+// moved while it was reading
+static volatile uint32_t latencyseq = 0;
+static uint32_t inputstamp[INPUT_QUEUE];
+// events applied but not yet seen by a strobe
+static uint32_t latpending[INPUT_QUEUE];
+static uint8_t latpendingdev[INPUT_QUEUE];
+static uint8_t latpendingcount = 0;
+// I2C readout, count/min/mean/p99/max for every histogram
+#define LATENCY_PAGE 0x80
+#define LATENCY_RESET 0x81
+static uint32_t latencyout[LAT_DEVICES * LAT_STAGES * 5];
+static uint8_t latencyindex = 0;
+static volatile bool latency_reset = false;
+
+// I2C readout of pio-usb's frame stats when built with PIO_USB_FRAME_STATS,
+// the pio_usb_host_frame_stats_t as it is, the reset page clears them after
+#define FRAMESTATS_PAGE 0x82
+#define FRAMESTATS_RESET 0x83
+static pio_usb_host_frame_stats_t framestats;
+static uint8_t framestatsindex = 0;
+
+// the input capture log, one record after another: kind, data length, the
+// uint32 microseconds since the log was reset, then the data. it takes
+// nothing more once full. reads of CAPTURE_PAGE carry on where the last
+// one stopped and give CAPTURE_END past the last record, a write to
+// CAPTURE_RESET empties it and starts the clock again
+#define CAPTURE_PAGE 0x84
+#define CAPTURE_RESET 0x85
+#define CAPTURE_BYTES 32768
+#define CAPTURE_HEADER 6
+#define CAPTURE_END 0
+#define CAPTURE_KEYS 1      // keyboard usages down, process_kbd_report()
+#define CAPTURE_MOUSE 2     // buttons, x and y as int16, wheel
+#define CAPTURE_PRESENT 3   // keyboard and mouse present bits, set_present()
+#define CAPTURE_I2C 4       // a host write, page byte first
+static uint8_t capturelog[INPUT_CAPTURE ? CAPTURE_BYTES : 1];
+static uint32_t capturelen = 0;
+static uint32_t captureindex = 0;
+static uint32_t capturestart = 0;
+static bool capturefull = false;
+
+// the capture INPUT_REPLAY plays back, in the same format
+#if INPUT_REPLAY && __has_include("input-replay.h")
+#include "input-replay.h"
+#else
+#if INPUT_REPLAY
+#error "INPUT_REPLAY needs an input-replay.h beside this file, i2chost/famikb-capture.py header <capture> makes one"
+#endif
+static const uint8_t input_replay[] = { CAPTURE_END };
+#endif
+static uint32_t replayindex = 0;
+static uint32_t replaystart = 0;
+
+// core1 copy of the latest mouse status, what the NES gets after a strobe
+static int16_t mselatest[4];
 // mouse updates won't be buffered like the keyboard, if multiple updates come
 // inbetween a frame, we want to put them together instead of stack them up
 // oversizing the buffer type to mitigate overflow
@@ -178,12 +349,39 @@ static int16_t mseinstbuf[4];
 static int8_t mousex;
 static int8_t mousey;
 
-static bool NESinlatch = false;
+// core1, relative motion not sent to the NES yet, in 1/256 counts so a
+// slowed down mouse still gets somewhere
+#define MSE_SUBPIXEL 256
+static int32_t msecarry[2];
+// per keyboard mode, how far one report can move and the gain (x/256) for
+// a USB report moving 0-7, 8-15 ... 120+ counts
+typedef struct {
+    int8_t min;
+    int8_t max;
+    uint16_t gain[16];
+} mouse_curve_t;
+static const mouse_curve_t msecurves[4] = {
+    // keyboard mouse host, a signed byte each
+    { -128, 127, { 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256 } },
+    // family basic, no mouse
+    { -128, 127, { 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256 } },
+    // subor, direction and 5 bits, ease off fast swipes
+    { -32, 31, { 256, 256, 240, 224, 208, 192, 176, 160, 152, 144, 136, 128, 128, 128, 128, 128 } },
+    // hori track, 4 bits, high resolution mice need slowing down a lot
+    { -8, 7, { 256, 192, 160, 128, 112, 96, 88, 80, 72, 64, 64, 64, 64, 64, 64, 64 } },
+};
 
 static uint8_t usb2kbmode;
 static bool i2chostmode = false;
 
 static uint32_t output = 0;
+// last word handed to nesoe, and whether the matrix or a shift register
+// changed since it was built
+static uint32_t lastoutput = 0xFFFFFFFF;
+static volatile bool output_dirty = true;
+// core1 loop passes vs. words actually pushed to the PIO
+static uint32_t nes_spins = 0;
+static uint32_t nes_updates = 0;
 static uint8_t select = 0;
 static uint8_t enable = 0;
 static uint8_t toggle = 0;
@@ -192,6 +390,25 @@ static bool instrobe = false;
 static uint32_t kbword = 0;
 static uint32_t mseword = 0;
 
+// HID interfaces we read reports from, and where their fields are
+// every keyboard and mouse behind the hub keeps its own state here, the NES
+// sees them merged into one keyboard and one mouse
+typedef struct {
+    uint8_t dev_addr;   // 0 for a free slot
+    uint8_t instance;
+    uint8_t count;
+    report_layout_t layouts[REPORT_LAYOUT_MAX];
+    uint32_t keys[REPORT_KEY_WORDS];    // keyboard keys down in the last report
+    uint8_t buttons;                    // mouse buttons down in the last report
+} hid_interface_t;
+static hid_interface_t hidinterfaces[CFG_TUH_HID];
+// keys down on any keyboard, what core1 has been told about
+static uint32_t allkeys[REPORT_KEY_WORDS];
+
+// key being repeated for SENDREPEATS, 0 for none, and the alarm timing it
+static volatile uint8_t repeatkey = 0;
+static int repeatalarm = -1;
+
 static uint8_t subormouse[4]; // three byte holder for subor mouse data (one byte pad)
 static uint8_t sbmouseindex = 0;
 static uint8_t sbmouselength = 0; // should be 1 or 3 each report
@@ -225,6 +442,43 @@ void pico_set_led(bool led_on) {
 }
 // -----------------------------------------------------------
 
+// fill the keycode lookups from the matrix layout for the current mode
+static void build_keyindex() {
+    const uint8_t *keys = famikey;
+    uint8_t count = sizeof(famikey);
+    if (usb2kbmode == 2) {
+        keys = suborkey;
+        count = sizeof(suborkey);
+    }
+
+    memset(keyindex, NO_MATRIX_KEY, sizeof(keyindex));
+    memset(keyindex2, NO_MATRIX_KEY, sizeof(keyindex2));
+    for (uint8_t i = 0; i < count; i++) {
+        uint8_t key = keys[i];
+        // unused subor cells
+        if (key == KEY_NONE) {
+            continue;
+        }
+        if (keyindex[key] == NO_MATRIX_KEY) {
+            keyindex[key] = i;
+        } else {
+            keyindex2[key] = i;
+        }
+    }
+}
+
+// set or clear one cell of the matrix, cell 0 of a block is D4 down to
+// cell 3 on D1
+static inline void set_matrix_key(uint8_t i, bool pressed) {
+    uint8_t bit = 0x10 >> (i & 3);
+    if (pressed) {
+        keymatrix[i >> 2] |= bit;
+    } else {
+        keymatrix[i >> 2] &= ~bit;
+    }
+    output_dirty = true;
+}
+
 // handle key input into the buffer or matrices
 static void keycode_handler(uint8_t ascii) {
     bool release;
@@ -233,122 +487,572 @@ static void keycode_handler(uint8_t ascii) {
         ascii = ascii & 127;
     }
 
-    if (usb2kbmode == 1 || usb2kbmode == 3) { // famikey modes
+    if (usb2kbmode > 0) { // famikey and subor modes
         // update the status of the key
-        for (uint8_t i = 0; i < sizeof(famikey); i++) {
-            if (famikey[i] == ascii) {
-                keymatrix[i] = release;
-                break;
+        uint8_t i = keyindex[ascii];
+        if (i != NO_MATRIX_KEY) {
+            set_matrix_key(i, release);
+            // some keys appear more than once in the matrix
+            i = keyindex2[ascii];
+            if (i != NO_MATRIX_KEY) {
+                set_matrix_key(i, release);
             }
         }
-    } else if (usb2kbmode == 2) { // subor mode
-        // update the status of the key
-        for (uint8_t i = 0; i < sizeof(suborkey); i++) {
-            if (suborkey[i] == ascii) {
-                keymatrix[i] = release;
-                // some keys appear more than once in the matrix
-                //break;
+    } else { // keyboard mouse host mode
+        if ((uint8_t)(keyhead - keytail) == MAX_BUFFER) {
+            // keys still waiting for the NES are kept, the newest one goes
+            keydrops++;
+        } else {
+            keybuffer[keyhead & (MAX_BUFFER - 1)] = ascii;
+            keyhead++;
+        }
+    }
+
+}
+
+// queue an input event for core1, never blocks as it runs in the I2C ISR
+// core0 has the USB callbacks and the repeat alarm IRQ posting, so keep
+// them from interleaving
+static void post_input(uint32_t event) {
+    uint32_t status = save_and_disable_interrupts();
+    uint8_t head = inputhead;
+    if ((uint8_t)(head - inputtail) == INPUT_QUEUE) {
+        input_dropped++;
+        restore_interrupts(status);
+        return;
+    }
+    inputqueue[head & (INPUT_QUEUE - 1)] = event;
+    if (LATENCY_STATS) {
+        inputstamp[head & (INPUT_QUEUE - 1)] = time_us_32();
+    }
+    // the event has to be in the queue before core1 can see it
+    __dmb();
+    inputhead = head + 1;
+    input_queued++;
+    restore_interrupts(status);
+    // wake core1 if it is sleeping in the DMA output mode
+    __sev();
+}
+
+// core0, add a record to the capture log. the I2C ISR reads and resets
+// it, so it only ever sees whole records
+static void capture_record(uint8_t kind, const uint8_t *data, uint8_t len) {
+    if (!INPUT_CAPTURE) {
+        return;
+    }
+    uint32_t status = save_and_disable_interrupts();
+    uint32_t at = time_us_32() - capturestart;
+    if (capturefull || capturelen + CAPTURE_HEADER + len > sizeof(capturelog)) {
+        // keep it a prefix of what happened, no gaps
+        capturefull = true;
+    } else {
+        uint8_t *r = &capturelog[capturelen];
+        r[0] = kind;
+        r[1] = len;
+        memcpy(&r[2], &at, sizeof(at));
+        memcpy(&r[CAPTURE_HEADER], data, len);
+        capturelen += CAPTURE_HEADER + len;
+    }
+    restore_interrupts(status);
+}
+
+static inline void post_key(uint8_t ascii) {
+    post_input(INPUT_EVENT(INPUT_KEY, 0, ascii));
+}
+
+// core0 alarm IRQ, send the held key again while the NES is keeping up
+// so a stalled game doesn't come back to a screen full of one letter
+static void repeat_alarm_callback(uint alarm_num) {
+    uint8_t key = repeatkey;
+    if (!key) {
+        return;
+    }
+    if ((uint8_t)(keyhead - keytail) < MAX_BUFFER / 2
+            && (uint8_t)(inputhead - inputtail) < INPUT_QUEUE / 2) {
+        post_key(key);
+    }
+    hardware_alarm_set_target(alarm_num, make_timeout_time_ms(REPEAT_RATE_MS));
+}
+
+// core1, add one sample to a latency histogram
+static void latency_record(latency_hist_t *h, uint32_t us) {
+    uint32_t bucket = us >> LATENCY_BUCKET_SHIFT;
+    if (bucket >= LATENCY_BUCKETS) {
+        bucket = LATENCY_BUCKETS - 1;
+    }
+    if (h->buckets[bucket] != 0xFFFF) {
+        h->buckets[bucket]++;
+    }
+    if (h->count == 0 || us < h->min) {
+        h->min = us;
+    }
+    if (us > h->max) {
+        h->max = us;
+    }
+    h->sum += us;
+    h->count++;
+}
+
+// core1, an event just went into the matrix/buffers
+static void latency_applied(uint8_t device, uint32_t stamp) {
+    if (device == LAT_NONE) {
+        return;
+    }
+    latencyseq++;
+    __dmb();
+    latency_record(&latency[device][LAT_APPLIED], time_us_32() - stamp);
+    __dmb();
+    latencyseq++;
+    // the NES has stopped strobing if this fills up, just lose the sample
+    if (latpendingcount < INPUT_QUEUE) {
+        latpending[latpendingcount] = stamp;
+        latpendingdev[latpendingcount] = device;
+        latpendingcount++;
+    }
+}
+
+// core1, the NES strobed and everything applied so far is visible to it
+static void latency_strobe() {
+    latencyseq++;
+    __dmb();
+    if (latency_reset) {
+        memset(latency, 0, sizeof(latency));
+        latpendingcount = 0;
+        latency_reset = false;
+    }
+    uint32_t now = time_us_32();
+    for (uint8_t i = 0; i < latpendingcount; i++) {
+        latency_record(&latency[latpendingdev[i]][LAT_STROBE], now - latpending[i]);
+    }
+    latpendingcount = 0;
+    __dmb();
+    latencyseq++;
+}
+
+// fill latencyout from the histograms, the 99th percentile is the top of
+// the bucket it falls in, or the max when that is the catch-all last one
+static void latency_fill() {
+    uint32_t *out = latencyout;
+    for (uint8_t d = 0; d < LAT_DEVICES; d++) {
+        for (uint8_t st = 0; st < LAT_STAGES; st++) {
+            const latency_hist_t *h = &latency[d][st];
+            uint32_t count = h->count;
+            uint32_t p99 = 0;
+            uint32_t seen = 0;
+            for (uint8_t b = 0; b < LATENCY_BUCKETS && count; b++) {
+                seen += h->buckets[b];
+                if (seen * 100 >= count * 99) {
+                    // the last bucket has no top, it takes all the rest
+                    p99 = b == LATENCY_BUCKETS - 1 ? h->max
+                        : ((uint32_t)(b + 1) << LATENCY_BUCKET_SHIFT) - 1;
+                    break;
+                }
             }
+            if (p99 > h->max) {
+                p99 = h->max;
+            }
+            *out++ = count;
+            *out++ = h->min;
+            *out++ = count ? (uint32_t)(h->sum / count) : 0;
+            *out++ = p99;
+            *out++ = h->max;
         }
-    } else { // keyboard mouse host mode
-        if ((bufferindex+1) == MAX_BUFFER) {
-            for (int i = 1; i < MAX_BUFFER; i++) {
-                keybuffer[i-1] = keybuffer[i];
+    }
+}
+
+// core0, in the I2C ISR. core1 goes on recording, so the histograms are
+// read again if latencyseq moved while they were being read
+static void latency_snapshot() {
+    uint32_t seq;
+    do {
+        // core1 only holds it odd for one strobe's worth of samples
+        while ((seq = latencyseq) & 1) {
+        }
+        __dmb();
+        latency_fill();
+        __dmb();
+    } while (latencyseq != seq);
+}
+
+// core1, add a relative move through the curve for the keyboard mode
+static void mouse_add(uint8_t axis, int8_t delta) {
+    mouse_curve_t const *curve = &msecurves[usb2kbmode];
+    uint8_t speed = delta < 0 ? -delta : delta;
+    int32_t carry = msecarry[axis] + delta * curve->gain[speed > 127 ? 15 : speed >> 3];
+    // don't let a long swipe keep the pointer moving after the mouse stops
+    int32_t limit = MSECARRY * curve->max * MSE_SUBPIXEL;
+    if (carry > limit) {
+        carry = limit;
+    } else if (carry < -limit) {
+        carry = -limit;
+    }
+    msecarry[axis] = carry;
+}
+
+// core1, take as much motion as one report can carry, the fraction and
+// anything past the limit stay for the next one
+static int8_t mouse_take(uint8_t axis) {
+    mouse_curve_t const *curve = &msecurves[usb2kbmode];
+    int32_t counts = msecarry[axis] / MSE_SUBPIXEL;
+    if (counts < curve->min) {
+        counts = curve->min;
+    } else if (counts > curve->max) {
+        counts = curve->max;
+    }
+    msecarry[axis] -= counts * MSE_SUBPIXEL;
+    return counts;
+}
+
+// core1, update the matrix/key buffer and mouse buffers from queued input
+static void apply_input_events() {
+    uint8_t tail = inputtail;
+    uint8_t head = inputhead;
+    // don't read events before core0 has finished writing them
+    __dmb();
+
+    while (tail != head) {
+        uint32_t event = inputqueue[tail & (INPUT_QUEUE - 1)];
+        uint32_t stamp = inputstamp[tail & (INPUT_QUEUE - 1)];
+        uint8_t hi = event >> 8;
+        uint8_t lo = event;
+        uint8_t device = LAT_MOUSE;
+        tail++;
+
+        switch (event >> 24) {
+        case INPUT_KEY:
+            keycode_handler(lo);
+            device = LAT_KEYBOARD;
+            break;
+        case INPUT_BUTTONS:
+            // or the buttons in, this means if a button is pressed it will
+            // stay "pressed" until the NES polls it (probably next frame)
+            msebuffer[0] |= hi;
+            msebuffer[3] |= lo;
+            // fall through
+        case INPUT_STATE:
+            mselatest[0] = hi;
+            mselatest[3] = lo;
+            new_input_msg = true;
+            // attach/detach and idle status, not something a user did
+            if ((event >> 24) == INPUT_STATE) {
+                device = LAT_NONE;
+            }
+            break;
+        case INPUT_MOVE:
+            // if true, we are in relative mode
+            if ((msebuffer[0] & 8) == 8) {
+                mouse_add(0, hi);
+                mouse_add(1, lo);
+            } else {
+                msebuffer[1] = (int8_t)hi;
+                msebuffer[2] = (int8_t)lo;
             }
-            keybuffer[bufferindex] = ascii;
+            mselatest[1] = (int8_t)hi;
+            mselatest[2] = (int8_t)lo;
+            new_input_msg = true;
+            break;
         }
-        else {
-            keybuffer[bufferindex] = ascii;
-            bufferindex++;
+        if (LATENCY_STATS) {
+            latency_applied(device, stamp);
         }
+        input_applied++;
     }
 
+    // and give their slots back to core0
+    __dmb();
+    inputtail = tail;
+}
+
+// mouse bytes 2-5 of a host message, status/x/y/extra
+static void post_host_mouse(const uint8_t *m) {
+    // only update mouse buffer if mouse is "present"
+    if ((m[0] & 32) == 32) {
+        // some wheel movements or middle button events could
+        // be missed. target for improvement later
+        post_input(INPUT_EVENT(INPUT_BUTTONS, m[0], m[3]));
+        post_input(INPUT_EVENT(INPUT_MOVE, m[1], m[2]));
+    } else {
+        post_input(INPUT_EVENT(INPUT_STATE, m[0], m[3]));
+    }
+}
+
+// core0, post the events of a v2 write in order
+static void i2c_v2_decode(const uint8_t *b, uint8_t len) {
+    // the SMBus length has to match, and so does the key count
+    uint8_t keys = b[2] & ~I2C_V2_MOUSE;
+    if (len < 3 || len > I2C_V2_MAX + 1 || b[0] != len - 1
+            || len != 3 + keys + ((b[2] & I2C_V2_MOUSE) ? 4 : 0)) {
+        hostv2.bad++;
+        return;
+    }
+    hostv2.gaps += (uint8_t)(b[1] - hostv2.seq);
+    hostv2.seq = b[1] + 1;
+
+    for (uint8_t i = 0; i < keys; i++) {
+        post_key(b[3 + i]);
+    }
+    if (b[2] & I2C_V2_MOUSE) {
+        post_host_mouse(&b[3 + keys]);
+    }
+}
+
+// core0, one host write the ISR queued, or one from a replay
+static void i2c_decode(uint8_t page, const uint8_t *buf, uint8_t len) {
+    if (INPUT_CAPTURE) {
+        // a write too long for the buffer is cut short, it is still bad
+        uint8_t r[1 + I2C_V2_MAX + 1];
+        uint8_t n = len < sizeof(r) - 1 ? len : sizeof(r) - 1;
+        r[0] = page;
+        memcpy(&r[1], buf, n);
+        capture_record(CAPTURE_I2C, r, 1 + n);
+    }
+
+    if (page == I2C_V2_PAGE) {
+        i2c_v2_decode(buf, len);
+    } else if (len >= sizeof(hostmsg.mem)) {
+        // parse the value from mem[1] if not 0x00
+        if (buf[1] != 0x00) {
+            post_key(buf[1]);
+        }
+        post_host_mouse(&buf[2]);
+    }
+}
+
+// core0 main loop, decode whatever host writes the ISR has queued
+static void i2c_host_task() {
+    uint8_t tail = i2crxtail;
+    uint8_t head = i2crxhead;
+    // don't read a message before the ISR has finished copying it
+    __dmb();
+
+    while (tail != head) {
+        const i2c_rx_msg_t *msg = &i2crx[tail & (I2C_RX_RING - 1)];
+        i2c_decode(msg->page, msg->buf, msg->len);
+        tail++;
+    }
+
+    // and give their slots back to the ISR
+    __dmb();
+    i2crxtail = tail;
 }
 
 // I2C configuration
 static const uint I2C_ADDRESS = 0x17;
-static const uint I2C_BAUDRATE = 100000; // 100 kHz
-// Our handler is called from the I2C ISR, so it must complete quickly. Blocking calls /
-// printing to stdio may interfere with interrupt handling.
-static void i2c_slave_handler(i2c_inst_t *i2c, i2c_slave_event_t event) {
-    switch (event) {
-    case I2C_SLAVE_RECEIVE: // master has written some data
-        if (!hostmsg.mem_address_written) {
-            // writes always start with the memory address
-            // the first value here is a len, ignore
-            hostmsg.mem_address = i2c_read_byte_raw(i2c);
-            // host should always address addr 0 in the buffer
-            if (hostmsg.mem_address != 0){
-                hostmsg.garbage_message = true;
-            } else {
-                hostmsg.garbage_message = false;
-            }
-            hostmsg.mem_address_written = true;
+// Fast-mode, still fine for a 100 kHz host. 1000000 for a Fast-mode Plus
+// host, which also shortens the data hold time below what slower ones want
+#ifndef I2C_BAUDRATE
+#define I2C_BAUDRATE 400000
+#endif
+// RX_FULL fires once this many bytes are waiting, half the 16 byte FIFO,
+// and each one drains all there are by then. the tail of a write is
+// drained at its stop or read request, and should core0 be late the
+// controller holds SCL with the FIFO full rather than drop bytes
+#define I2C_RX_THRESHOLD 8
+
+// I2C ISR, a write to us has ended, hand it over to the main loop
+static void i2c_queue_message() {
+    uint8_t head = i2crxhead;
+    if ((uint8_t)(head - i2crxtail) == I2C_RX_RING) {
+        // a v2 host sees this as a gap in the sequence
+        i2crx_dropped++;
+        return;
+    }
+    i2c_rx_msg_t *msg = &i2crx[head & (I2C_RX_RING - 1)];
+    if (hostmsg.mem_address == I2C_V2_PAGE) {
+        msg->page = I2C_V2_PAGE;
+        msg->len = hostv2.len;
+        memcpy(msg->buf, hostv2.buf, hostv2.len < sizeof(msg->buf) ? hostv2.len : sizeof(msg->buf));
+    } else {
+        msg->page = 0;
+        msg->len = sizeof(hostmsg.mem);
+        memcpy(msg->buf, hostmsg.mem, sizeof(hostmsg.mem));
+    }
+    __dmb();
+    i2crxhead = head + 1;
+    // wake the main loop, even if it is only about to sleep
+    __sev();
+}
+
+// I2C ISR, the write in progress is over. one with nothing after the page
+// byte only picks what is read back, a v2 one included as the status read
+static void i2c_finish_write() {
+    if (hostmsg.mem_address_written && (hostmsg.mem_address == I2C_V2_PAGE
+            ? hostv2.len > 0 : hostmsg.data_written && !hostmsg.garbage_message)) {
+        i2c_queue_message();
+    }
+    hostmsg.mem_address_written = false;
+}
+
+// I2C ISR, one byte the host wrote
+static void i2c_receive_byte(uint8_t value) {
+    if (!hostmsg.mem_address_written) {
+        // writes always start with the memory address
+        // the first value here is a len, ignore
+        hostmsg.mem_address = value;
+        if (LATENCY_STATS && hostmsg.mem_address == LATENCY_PAGE) {
+            // the host reads the latency stats back after this write
+            latency_snapshot();
+            latencyindex = 0;
+        } else if (LATENCY_STATS && hostmsg.mem_address == LATENCY_RESET) {
+            latency_reset = true;
+        } else if (PIO_USB_FRAME_STATS && (hostmsg.mem_address == FRAMESTATS_PAGE
+                || hostmsg.mem_address == FRAMESTATS_RESET)) {
+            pio_usb_host_get_frame_stats(&framestats, hostmsg.mem_address == FRAMESTATS_RESET);
+            framestatsindex = 0;
+        } else if (INPUT_CAPTURE && hostmsg.mem_address == CAPTURE_RESET) {
+            // capture_record() has interrupts off, so never half way through
+            capturelen = 0;
+            captureindex = 0;
+            capturefull = false;
+            capturestart = time_us_32();
+        } else if (hostmsg.mem_address == I2C_V2_PAGE) {
+            hostv2.len = 0;
+            hostv2.status[0] = hostv2.seq;
+            hostv2.status[1] = I2C_V2_VERSION;
+            hostv2.status[2] = hostv2.gaps & 0xff;
+            hostv2.status[3] = hostv2.gaps >> 8;
+            hostv2.status[4] = hostv2.bad & 0xff;
+            hostv2.status[5] = hostv2.bad >> 8;
+            hostv2.statusindex = 0;
+        }
+        // host should always address addr 0 in the buffer
+        if (hostmsg.mem_address != 0){
+            hostmsg.garbage_message = true;
         } else {
-            // if it is garbage we just read the values
-            // but don't put them in memory
-            if (hostmsg.garbage_message) {
-                i2c_read_byte_raw(i2c);
-            }
-            else { // put thew values into buffer
-                hostmsg.mem[hostmsg.mem_address] = i2c_read_byte_raw(i2c);
-                hostmsg.mem_address = (hostmsg.mem_address + 1) % 6;
-            }
+            hostmsg.garbage_message = false;
         }
-        break;
-    case I2C_SLAVE_REQUEST: // master is requesting data
-        // load from memory
-        i2c_write_byte_raw(i2c, hostmsg.mem[hostmsg.mem_address]);
-        hostmsg.mem_address = (hostmsg.mem_address + 1) % 6;
-        break;
-    case I2C_SLAVE_FINISH: // master has signalled Stop / Restart
-        if (!hostmsg.garbage_message) {
-            // parse the value from mem[1] if not 0x00
-            if (hostmsg.mem[1] != 0x00) {
-                keycode_handler(hostmsg.mem[1]);
+        hostmsg.mem_address_written = true;
+        hostmsg.data_written = false;
+    } else {
+        hostmsg.data_written = true;
+        // v2 has its own buffer, garbage is just dropped
+        if (hostmsg.mem_address == I2C_V2_PAGE) {
+            if (hostv2.len < sizeof(hostv2.buf)) {
+                hostv2.buf[hostv2.len] = value;
             }
-            // only update mouse buffer if mouse is "present"
-            if ((hostmsg.mem[2] & 32) == 32) {
-                // and the first byte with the current value
-                // this means if a button is pressed, it will stay "pressed"
-                // until the NES polls it (probably next frame)
-                msebuffer[0] |= hostmsg.mem[2];
-                // if true, we are in relative mode
-                if ((msebuffer[0] & 8) == 8 && new_input_msg) {
-                    msebuffer[1] += (int8_t)hostmsg.mem[3];
-                    msebuffer[2] += (int8_t)hostmsg.mem[4];
-                } else {
-                    msebuffer[1] = (int8_t)hostmsg.mem[3];
-                    msebuffer[2] = (int8_t)hostmsg.mem[4];   
-                }
-                // some wheel movements or middle button events could
-                // be missed. target for improvement later
-                msebuffer[3] |= hostmsg.mem[5];
+            // one past the buffer marks it as too long
+            if (hostv2.len <= sizeof(hostv2.buf)) {
+                hostv2.len++;
             }
-            new_input_msg = true;
+        } else if (!hostmsg.garbage_message) {
+            // put thew values into buffer
+            hostmsg.mem[hostmsg.mem_address] = value;
+            hostmsg.mem_address = (hostmsg.mem_address + 1) % 6;
         }
-        
-        hostmsg.mem_address_written = false;
-        
-        break;
-    default:
-        break;
     }
 }
 
+// I2C ISR, everything in the RX FIFO. the controller flags the first byte
+// after each address, which ends whatever write came before
+static void i2c_drain(i2c_hw_t *hw) {
+    size_t avail = i2c_get_read_available(i2c0);
+    while (avail--) {
+        uint32_t data = hw->data_cmd;
+        if (data & I2C_IC_DATA_CMD_FIRST_DATA_BYTE_BITS) {
+            i2c_finish_write();
+        }
+        i2c_receive_byte(data & I2C_IC_DATA_CMD_DAT_BITS);
+    }
+}
+
+// I2C ISR, one byte of the page the host is reading
+static void i2c_send_byte() {
+    if (LATENCY_STATS && hostmsg.mem_address == LATENCY_PAGE) {
+        i2c_write_byte_raw(i2c0, ((uint8_t *)latencyout)[latencyindex]);
+        latencyindex = (latencyindex + 1) % sizeof(latencyout);
+        return;
+    }
+    if (PIO_USB_FRAME_STATS && (hostmsg.mem_address == FRAMESTATS_PAGE
+            || hostmsg.mem_address == FRAMESTATS_RESET)) {
+        i2c_write_byte_raw(i2c0, ((uint8_t *)&framestats)[framestatsindex]);
+        framestatsindex = (framestatsindex + 1) % sizeof(framestats);
+        return;
+    }
+    if (INPUT_CAPTURE && hostmsg.mem_address == CAPTURE_PAGE) {
+        i2c_write_byte_raw(i2c0, captureindex < capturelen ? capturelog[captureindex++] : CAPTURE_END);
+        return;
+    }
+    if (hostmsg.mem_address == I2C_V2_PAGE) {
+        i2c_write_byte_raw(i2c0, hostv2.status[hostv2.statusindex]);
+        hostv2.statusindex = (hostv2.statusindex + 1) % sizeof(hostv2.status);
+        return;
+    }
+    // load from memory
+    i2c_write_byte_raw(i2c0, hostmsg.mem[hostmsg.mem_address]);
+    hostmsg.mem_address = (hostmsg.mem_address + 1) % 6;
+}
+
+// The I2C0 IRQ, it must complete quickly. Blocking calls / printing to
+// stdio may interfere with interrupt handling. pico_i2c_slave only ends a
+// transfer it has seen RX_FULL or a read request for, which kept the
+// threshold at one byte, so writes are framed here instead: by the first
+// byte flag, the read request and the stop
+static void i2c_IRQ_handler() {
+    i2c_hw_t *hw = i2c_get_hw(i2c0);
+    uint32_t stat = hw->intr_stat;
+    if (stat & I2C_IC_INTR_STAT_R_TX_ABRT_BITS) {
+        hw->clr_tx_abrt;
+    }
+    // RX_FULL, or the tail of a write under the threshold
+    i2c_drain(hw);
+    if (stat & I2C_IC_INTR_STAT_R_STOP_DET_BITS) {
+        hw->clr_stop_det;
+        // with the bus busy again the next transfer has already begun, its
+        // first byte or read request ends this write
+        if (!(hw->status & I2C_IC_STATUS_SLV_ACTIVITY_BITS)) {
+            i2c_drain(hw);
+            i2c_finish_write();
+        }
+    }
+    if (stat & I2C_IC_INTR_STAT_R_RD_REQ_BITS) {
+        hw->clr_rd_req;
+        // the page select of a write, restart, read, or a write whose stop
+        // came with this read already addressed
+        i2c_finish_write();
+        i2c_send_byte();
+    }
+}
+
+static void i2c_slave_start() {
+    gpio_init(I2C_SDA_PIN);
+    gpio_set_function(I2C_SDA_PIN, GPIO_FUNC_I2C);
+    gpio_pull_up(I2C_SDA_PIN);
+
+    gpio_init(I2C_SCL_PIN);
+    gpio_set_function(I2C_SCL_PIN, GPIO_FUNC_I2C);
+    gpio_pull_up(I2C_SCL_PIN);
+
+    i2c_init(i2c0, I2C_BAUDRATE);
+    // configure I2C0 for slave mode
+    i2c_set_slave_mode(i2c0, true, I2C_ADDRESS);
+    i2c_hw_t *hw = i2c_get_hw(i2c0);
+    // IC_CON only takes writes with the controller off
+    hw->enable = 0;
+    hw_set_bits(&hw->con, I2C_IC_CON_RX_FIFO_FULL_HLD_CTRL_BITS);
+    hw->rx_tl = I2C_RX_THRESHOLD - 1;
+    hw->intr_mask = I2C_IC_INTR_MASK_M_RX_FULL_BITS | I2C_IC_INTR_MASK_M_RD_REQ_BITS
+        | I2C_IC_INTR_MASK_M_TX_ABRT_BITS | I2C_IC_INTR_MASK_M_STOP_DET_BITS;
+    hw->enable = 1;
+    irq_set_exclusive_handler(I2C0_IRQ, i2c_IRQ_handler);
+    irq_set_enabled(I2C0_IRQ, true);
+}
+
 // when mouse data is sent to the NES, update relevant buffer data
 static void update_mouse_data() {
     // if there is new data from the host
     if (new_input_msg) {
         if (i2chostmode) {
             // actually update button values
-            msebuffer[0] = hostmsg.mem[2];
-            msebuffer[3] = hostmsg.mem[5];
+            msebuffer[0] = mselatest[0];
+            msebuffer[3] = mselatest[3];
         } else {
-            msebuffer[0] = mseinstbuf[0];
-            msebuffer[1] = mseinstbuf[1];
-            msebuffer[2] = mseinstbuf[2];
-            msebuffer[3] = mseinstbuf[3] & 0x87;
+            msebuffer[0] = mselatest[0];
+            // relative motion comes out of msecarry instead
+            if ((mselatest[0] & 8) == 0) {
+                msebuffer[1] = mselatest[1];
+                msebuffer[2] = mselatest[2];
+            }
+            msebuffer[3] = mselatest[3] & 0x87;
         }
         new_input_msg = false;
     }
@@ -369,14 +1073,73 @@ void pio_IRQ_handler() {
         else if (usb2kbmode == 3) {
             horitrack = horitrack << 1;
         }
+        output_dirty = true;
 
         pio_interrupt_clear(pio0, 3);
+        if (SLEEP_CORE1) {
+            __sev();
+        }
     }
 }
 
+// $4016 edge while core1 sleeps, the loop pass after __wfe() does the work
+void nes_out_callback(uint gpio, uint32_t events) {
+    (void)gpio;
+    (void)events;
+    // in case it landed between the loop reading $4016 and the __wfe()
+    __sev();
+}
+
+// strobe, row advance and enable edges wake core1, as do the OE IRQ and
+// core0 posting input
+static void nes_sleep_init() {
+    for (uint i = 0; i < 3; i++) {
+        gpio_set_irq_enabled_with_callback(NES_OUT + i,
+            GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true, &nes_out_callback);
+    }
+    // so the first pass puts something on $4017 straight away
+    __sev();
+}
+
+// IRQ handler for the strobe when PIO+DMA answers the reads
+void pio_strobe_IRQ_handler() {
+
+    if (pio_interrupt_get(pio0, 0)) {
+        // same as the core1 loop, everything sent before the strobe
+        // is part of this scan
+        apply_input_events();
+        usb2famikb_restart_dma();
+        if (LATENCY_STATS) {
+            latency_strobe();
+        }
+
+        pio_interrupt_clear(pio0, 0);
+    }
+}
 
 void nes_handler_thread() {
 
+    if (DMA_OUTPUT && usb2kbmode == 1) {
+        // the 18 famikb blocks in keymatrix are already the D0-D4 values
+        usb2famikb_init_dma(NES_OUT, NES_DATA, keymatrix, 18);
+
+        pio_set_irq0_source_enabled(pio0, pis_interrupt0, true);
+        irq_set_exclusive_handler(PIO0_IRQ_0, pio_strobe_IRQ_handler);
+        irq_set_enabled(PIO0_IRQ_0, true);
+
+        for (;;) {
+            // woken by the strobe IRQ or core0 posting input
+            __wfe();
+
+            // if the NES isn't strobing, don't let core0 back up
+            if ((uint8_t)(inputhead - inputtail) >= INPUT_QUEUE / 2) {
+                uint32_t status = save_and_disable_interrupts();
+                apply_input_events();
+                restore_interrupts(status);
+            }
+        }
+    }
+
     usb2famikb_init(NES_OUT, NES_JOY1OE, NES_JOY2OE, NES_DATA, usb2kbmode);
 
     
@@ -387,10 +1150,30 @@ void nes_handler_thread() {
             irq_set_exclusive_handler(PIO0_IRQ_0, pio_IRQ_handler);
         }
         irq_set_enabled(PIO0_IRQ_0, true);
+        if (SLEEP_CORE1) {
+            nes_sleep_init();
+        }
 
+        uint8_t lastread = 0xFF;
         for (;;) {
+            if (SLEEP_CORE1) {
+                __wfe();
+            }
             //  read the current $4016 ouput
             uint8_t nesread = (pio0->intr >> 8) & 0x0F;
+            nes_spins++;
+
+            // if the NES isn't strobing, don't let core0 back up
+            if ((uint8_t)(inputhead - inputtail) >= INPUT_QUEUE / 2) {
+                apply_input_events();
+            }
+
+            // nothing to do until $4016 or the data behind it changes
+            if (INCREMENTAL_OUTPUT && nesread == lastread && !output_dirty) {
+                continue;
+            }
+            lastread = nesread;
+            output_dirty = false;
             
             // fami/subor keyboard enable
             enable = nesread & 4;
@@ -405,13 +1188,19 @@ void nes_handler_thread() {
             // only reset/prepare data if beginning of strobe
             if (strobe && !instrobe) {  //  reset keyboard row/strobe mouse
                 instrobe = true;
+                // everything core0 sent before the strobe is part of this read
+                apply_input_events();
+                if (LATENCY_STATS) {
+                    latency_strobe();
+                }
                 // if the keyboard is enabled, reset it to prepare for reading 
                 select = 0;
                 toggle = 0;
 
-                // if there is new data, load it
-                // otherwise, give a 0
-                if (new_input_msg) {
+                // if there is a new absolute position, load it
+                // otherwise, give a 0, relative motion is taken from
+                // msecarry when a report is built
+                if ((msebuffer[0] & 8) == 0 && new_input_msg) {
                     if (msebuffer[1] < -128) {
                         mousex = -128;
                     } else if (msebuffer[1] > 127) {
@@ -444,6 +1233,10 @@ void nes_handler_thread() {
                         sbmouselength = 0;
                         
                         if (!enable) {
+                            if (msebuffer[0] & 8) {
+                                mousex = mouse_take(0);
+                                mousey = mouse_take(1);
+                            }
                             // it is a single byte report
                             if ((mousex >= -1 && mousex <= 1) && (mousey >= -1 && mousey <= 1)) {
                                 sbmouselength = 1;
@@ -507,6 +1300,10 @@ void nes_handler_thread() {
                     horitrack = 0x00;
                     horitrack |= msebuffer[0] & 0xC0;
                     horitrack <<= 4;
+                    if (msebuffer[0] & 8) {
+                        mousex = mouse_take(0);
+                        mousey = mouse_take(1);
+                    }
                     if (mousex < -8) {
                         mousex = -8;
                     } else if (mousex > 7) {
@@ -539,10 +1336,7 @@ void nes_handler_thread() {
             // set current output value on $4017
             output = 0x1E;  //  if keyboard is not enabled return 1s (console 0s)
             if (enable > 0) {
-                for (int i = (4 * select); i < (4 * select)+4; i++) {
-                    output += keymatrix[i];
-                    output = output << 1;
-                }
+                output = keymatrix[select];
             }
 
             if (usb2kbmode == 2) {
@@ -552,7 +1346,11 @@ void nes_handler_thread() {
                 output += (horitrack >> 31) ? 0: 1;
             }
 
-            usb2famikb_putkb(output);
+            if (!INCREMENTAL_OUTPUT || output != lastoutput) {
+                lastoutput = output;
+                nes_updates++;
+                usb2famikb_putkb(output);
+            }
         }
 
     } else {
@@ -560,10 +1358,29 @@ void nes_handler_thread() {
         pio_set_irq0_source_enabled(pio0, pis_interrupt3, true);
         irq_set_exclusive_handler(PIO0_IRQ_0, pio_IRQ_handler);
         irq_set_enabled(PIO0_IRQ_0, true);
+        if (SLEEP_CORE1) {
+            nes_sleep_init();
+        }
 
+        uint8_t lastread = 0xFF;
         for (;;) {
+            if (SLEEP_CORE1) {
+                __wfe();
+            }
 
             uint8_t nesread = (pio0->intr >> 8) & 0x0F;
+            nes_spins++;
+
+            // if the NES isn't strobing, don't let core0 back up
+            if ((uint8_t)(inputhead - inputtail) >= INPUT_QUEUE / 2) {
+                apply_input_events();
+            }
+
+            if (INCREMENTAL_OUTPUT && nesread == lastread && !output_dirty) {
+                continue;
+            }
+            lastread = nesread;
+            output_dirty = false;
             
             // read the strobe value, if was previously in strobe
             // exit strobe if no longer in strobe
@@ -575,32 +1392,43 @@ void nes_handler_thread() {
             // check for strobe signal and latch the buffers
             if (strobe && !instrobe) {  //  reset keyboard row/strobe mouse
                 instrobe = true;
-                // check if latched for buffer context
-                NESinlatch = true;
+                // everything core0 sent before the strobe is part of this read
+                apply_input_events();
+                if (LATENCY_STATS) {
+                    latency_strobe();
+                }
+
+                uint8_t tail = keytail;
+                uint8_t c = keyhead - tail;
+                if (c > WORD_SIZE) {
+                    c = WORD_SIZE;
+                }
+                // don't read keys before core0 has finished writing them
+                __dmb();
+
+                if (msebuffer[0] & 8) {
+                    msebuffer[1] = mouse_take(0);
+                    msebuffer[2] = mouse_take(1);
+                }
 
                 kbword = 0x00000000;
                 mseword = 0x00000000;
-                // load the four oldest buffered values
+                // load the four oldest buffered values, 0 past the end
                 for (int i = 0; i < WORD_SIZE; i++) {
                     kbword = kbword << 8;
-                    kbword += keybuffer[i];
+                    if (i < c) {
+                        kbword += keybuffer[(uint8_t)(tail + i) & (MAX_BUFFER - 1)];
+                    }
                     // mouse doesn't actually have a history
                     // just get the latest values
                     mseword = mseword << 8;
                     mseword += (uint8_t) msebuffer[i];
                 }
-                int c = WORD_SIZE;
-                if (bufferindex < WORD_SIZE) {
-                    c = bufferindex;
-                }
-                for (int i = c; i < MAX_BUFFER; i++) {
-                    keybuffer[i-c] = keybuffer[i];
-                }
-                bufferindex = bufferindex - c;
+                // and give their slots back to core0
+                __dmb();
+                keytail = tail + c;
 
                 update_mouse_data();
-
-                NESinlatch = false;
             }
 
             uint32_t serialout = 3;
@@ -609,12 +1437,18 @@ void nes_handler_thread() {
             // push the next keyboard bit in
             serialout += (~kbword & 0x80000000) >> 28;
         
-            usb2famikb_putkb(serialout);
+            if (!INCREMENTAL_OUTPUT || serialout != lastoutput) {
+                lastoutput = serialout;
+                nes_updates++;
+                usb2famikb_putkb(serialout);
+            }
         }
     }
 
 }
 
+static bool input_replay_task();
+
 int main() {
     // need a clock speed that is a multiple of 12,000
     //set_sys_clock_khz(264000, true);
@@ -639,6 +1473,9 @@ int main() {
     i2chostmode = gpio_get(i2cHOST_ENABLE);
 
     // prepare buffers
+    if (usb2kbmode > 0) {
+        build_keyindex();
+    }
     for (int i = 0; i < MAX_BUFFER; i++) {
         keybuffer[i] = 0x00;
     }
@@ -650,7 +1487,10 @@ int main() {
     // set only the device id in the buffer so if the NES
     // strobes for update before data received it will know
     // the interface is present
-    msebuffer[0] = mseinstbuf[0] = 0x06;
+    msebuffer[0] = mseinstbuf[0] = mselatest[0] = 0x06;
+
+    // INPUT_REPLAY times are from here
+    replaystart = time_us_32();
 
     multicore_reset_core1();
     //  run the NES handler on seperate core
@@ -661,32 +1501,15 @@ int main() {
     pico_set_led(true);
 
     if (i2chostmode) {
-        gpio_init(I2C_SDA_PIN);
-        gpio_set_function(I2C_SDA_PIN, GPIO_FUNC_I2C);
-        gpio_pull_up(I2C_SDA_PIN);
+        i2c_slave_start();
 
-        gpio_init(I2C_SCL_PIN);
-        gpio_set_function(I2C_SCL_PIN, GPIO_FUNC_I2C);
-        gpio_pull_up(I2C_SCL_PIN);
-
-        
-        i2c_init(i2c0, I2C_BAUDRATE);
-        // configure I2C0 for slave mode
-        i2c_slave_init(i2c0, I2C_ADDRESS, &i2c_slave_handler);
-
-        // loop forever now
+        // loop forever now, decoding host writes as the ISR queues them
         for (;;) {
-            if ((transbbindex != kbbbindex) && !NESinlatch){
-                // if the buffer is full, don't do anything yet
-                if ((bufferindex+1) < MAX_BUFFER) {
-                    keybuffer[bufferindex] = kbbackbuffer[transbbindex];
-                    bufferindex++;
-
-                    transbbindex = (transbbindex + 1) % MAX_BUFFER;
-                } 
+            i2c_host_task();
+            // until the ISR queues the next one, a replay is polled
+            if (!INPUT_REPLAY || !input_replay_task()) {
+                __wfe();
             }
-            // gets a little ansy without a little sleep here
-            sleep_ms(1);
         }
         
     }
@@ -694,6 +1517,21 @@ int main() {
         mseinstbuf[0] |= MSERELATIVE << 3;
         sleep_ms(10);
 
+        // the stats and capture pages can be read with the USB host running too
+        if (LATENCY_STATS || PIO_USB_FRAME_STATS || INPUT_CAPTURE) {
+            i2c_slave_start();
+        }
+
+        // the serialized keyboard gets typematic repeats from an alarm, the
+        // matrix modes just hold the key down
+        if (SENDREPEATS && usb2kbmode == 0) {
+            repeatalarm = hardware_alarm_claim_unused(true);
+            hardware_alarm_set_callback(repeatalarm, &repeat_alarm_callback);
+        }
+
+        // read report protocol, boot protocol limits keyboards to 6 keys
+        tuh_hid_set_default_protocol(HID_PROTOCOL_REPORT);
+
         // Use tuh_configure() to pass pio configuration to the host stack
         // Note: tuh_configure() must be called before
         pio_usb_configuration_t pio_cfg = PIO_USB_CONFIG;
@@ -712,6 +1550,12 @@ int main() {
 
         while (true) {
             tuh_task(); // tinyusb host task
+            if (LATENCY_STATS || PIO_USB_FRAME_STATS || INPUT_CAPTURE) {
+                i2c_host_task();
+            }
+            if (INPUT_REPLAY) {
+                input_replay_task();
+            }
         }
     }
 
@@ -721,128 +1565,94 @@ int main() {
 // Host HID
 //--------------------------------------------------------------------+
 
-// Invoked when device with hid interface is mounted
-// Report descriptor is also available for use. tuh_hid_parse_report_descriptor()
-// can be used to parse common/simple enough descriptor.
-// Note: if report descriptor length > CFG_TUH_ENUMERATION_BUFSIZE, it will be skipped
-// therefore report_desc = NULL, desc_len = 0
-void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_report, uint16_t desc_len)
-{
-    (void)desc_report;
-    (void)desc_len;
-
-    // Interface protocol (hid_interface_protocol_enum_t)
-    uint8_t const itf_protocol = tuh_hid_interface_protocol(dev_addr, instance);
-
-    // Receive report from boot keyboard & mouse only
-    // tuh_hid_report_received_cb() will be invoked when report is available
-    if (itf_protocol == HID_ITF_PROTOCOL_KEYBOARD || itf_protocol == HID_ITF_PROTOCOL_MOUSE) {
-        switch (itf_protocol) {
-            case (HID_ITF_PROTOCOL_KEYBOARD):
-                mseinstbuf[0] |= 0x10;
-                break;
-            case (HID_ITF_PROTOCOL_MOUSE):
-                mseinstbuf[0] |= 0x20;
-                break;
-        }
-        new_input_msg = true;
-
-        //  set up report receiving
-        tuh_hid_receive_report(dev_addr, instance);
-
+// the last key pressed repeats until it is released
+static void repeat_key(uint8_t keycode, bool pressed) {
+    if (pressed) {
+        repeatkey = keycode;
+        hardware_alarm_set_target(repeatalarm, make_timeout_time_ms(REPEAT_DELAY_MS));
+    } else if (keycode == repeatkey) {
+        repeatkey = 0;
+        hardware_alarm_cancel(repeatalarm);
     }
 }
 
-// Invoked when device with hid interface is un-mounted
-void tuh_hid_umount_cb(uint8_t dev_addr, uint8_t instance)
+// post one keyboard usage to core1, modifiers go by their modkeys code
+static inline void post_usage(uint8_t usage, bool pressed)
 {
-    uint8_t const itf_protocol = tuh_hid_interface_protocol(dev_addr, instance);
-    
-    switch (itf_protocol) {
-        case (HID_ITF_PROTOCOL_KEYBOARD):
-            mseinstbuf[0] &= 0xEF;
-            break;
-        case (HID_ITF_PROTOCOL_MOUSE):
-            mseinstbuf[0] &= 0xDF;
-            break;
+    uint8_t keycode = usage;
+    if (usage >= 0xE0 && usage <= 0xE7) {
+        keycode = modkeys[usage - 0xE0];
+    } else if (usage >= 0x80) {
+        // bit 7 is the release flag on the way to core1
+        return;
+    } else if (repeatalarm >= 0) {
+        repeat_key(keycode, pressed);
     }
-    new_input_msg = true;
+    post_key(pressed ? keycode : keycode + 0x80);
 }
 
-// look up new key in previous keys
-static inline bool find_key_in_report(hid_keyboard_report_t const *report, uint8_t keycode)
+// process the kbd report and send to keycode handler
+// every key that changed since the last report is posted, releases first,
+// then modifier presses so shift+key in one report comes out shifted
+static void process_kbd_report(uint32_t *prev_keys, uint32_t const *keys)
 {
-    for(uint8_t i=0; i<6; i++) {
-        if (report->keycode[i] == keycode)  return true;
+    if (INPUT_CAPTURE) {
+        // the usages down rather than the whole bitmap
+        uint8_t down[255];
+        uint8_t n = 0;
+        for (uint8_t w = 0; w < REPORT_KEY_WORDS; w++) {
+            uint32_t bits = keys[w];
+            while (bits && n < sizeof(down)) {
+                down[n++] = w * 32 + __builtin_ctz(bits);
+                bits &= bits - 1;
+            }
+        }
+        capture_record(CAPTURE_KEYS, down, n);
     }
 
-    return false;
-}
-
-// check if a keycode is missing from prev report
-static inline void find_releases_in_report(hid_keyboard_report_t const *prev_report, hid_keyboard_report_t const *report)
-{
-    for(uint8_t i=0; i<6; i++)
-    {
-        if (prev_report->keycode[i] == 0x00) { break; }
-        if (prev_report->keycode[i] != report->keycode[i]) {
-            keycode_handler(prev_report->keycode[i] + 0x80);
-            break;
-        }
+    uint32_t changed[REPORT_KEY_WORDS];
+    for (uint8_t w = 0; w < REPORT_KEY_WORDS; w++) {
+        changed[w] = prev_keys[w] ^ keys[w];
     }
-}
 
-// check if modifier keys have changed
-static inline void update_modifiers(hid_keyboard_report_t const *prev_report, hid_keyboard_report_t const *report)
-{
-    uint8_t c = 1;
-    for(uint8_t i=0; i<8; i++)
-    {
-        if ((prev_report->modifier & c) != (report->modifier & c)){
-            if ((report->modifier & c) == 0){ // modifier released
-                keycode_handler(modkeys[i] + 0x80);
-            } else {
-                keycode_handler(modkeys[i]);
-            }
+    for (uint8_t w = 0; w < REPORT_KEY_WORDS; w++) {
+        uint32_t released = changed[w] & ~keys[w];
+        while (released) {
+            post_usage(w * 32 + __builtin_ctz(released), false);
+            released &= released - 1;
         }
-        c <<= 1;
     }
-}
 
-// process the kbd report and send to keycode handler
-static void process_kbd_report(hid_keyboard_report_t const *report)
-{
-    static hid_keyboard_report_t prev_report = { 0, 0, {0} }; // previous report to check key released
-
-    // keycode positions change when released, so need to check all
-    find_releases_in_report(&prev_report, report);
-    // check if modifier keys have changed
-    update_modifiers(&prev_report, report);
-
-    for(uint8_t i=0; i<6; i++)
-    {
-        uint8_t keycode = report->keycode[i];
-        if ( keycode )
-        {
-            if (find_key_in_report(&prev_report, keycode)) {
-                // ignore for now would like a repeat thing
-            } else {
-                keycode_handler(keycode);
-            }
+    // the modifiers are the top word
+    for (uint8_t i = 0; i < REPORT_KEY_WORDS; i++) {
+        uint8_t w = (i + REPORT_KEY_WORDS - 1) % REPORT_KEY_WORDS;
+        uint32_t pressed = changed[w] & keys[w];
+        while (pressed) {
+            post_usage(w * 32 + __builtin_ctz(pressed), true);
+            pressed &= pressed - 1;
         }
     }
 
-    prev_report = *report;
+    memcpy(prev_keys, keys, REPORT_KEY_WORDS * sizeof(keys[0]));
 }
 
 // process the mouse report and insert into buffers
-static void process_mouse_report(hid_mouse_report_t const *report)
+static void process_mouse_report(report_mouse_t const *report)
 {
+    if (INPUT_CAPTURE) {
+        uint8_t m[6] = {
+            report->buttons,
+            (uint16_t)report->x & 0xff, (uint16_t)report->x >> 8,
+            (uint16_t)report->y & 0xff, (uint16_t)report->y >> 8,
+            (uint8_t)report->wheel,
+        };
+        capture_record(CAPTURE_MOUSE, m, sizeof(m));
+    }
+
     uint8_t temp = mseinstbuf[0] & 0x3F;
     temp |= (report->buttons & MOUSE_BUTTON_LEFT) << 7;
     temp |= (report->buttons & MOUSE_BUTTON_RIGHT) << 5;
     mseinstbuf[0] = temp;
-    msebuffer[0] |= mseinstbuf[0];
 
     temp = 0x00;
     temp |= (report->buttons & MOUSE_BUTTON_MIDDLE) << 5;
@@ -850,18 +1660,20 @@ static void process_mouse_report(hid_mouse_report_t const *report)
     temp |= HORILHAND << 1;
     temp |= HORILOWSPD;
     mseinstbuf[3] = temp;
-    msebuffer[3] |= mseinstbuf[3];
+    post_input(INPUT_EVENT(INPUT_BUTTONS, mseinstbuf[0], mseinstbuf[3]));
 
     if (MSERELATIVE) {
-        if (new_input_msg) {
-            msebuffer[1] += report->x;
-            msebuffer[2] += report->y;
-            mseinstbuf[1] = report->x;
-            mseinstbuf[2] = report->y;
-        } else {
-            msebuffer[1] = mseinstbuf[1] = report->x;
-            msebuffer[2] = mseinstbuf[2] = report->y;
-        }
+        // core1 adds these up in msecarry, a byte at a time, so a high
+        // resolution mouse moving further than that goes in pieces
+        int16_t x = report->x;
+        int16_t y = report->y;
+        do {
+            mseinstbuf[1] = x < -128 ? -128 : x > 127 ? 127 : x;
+            mseinstbuf[2] = y < -128 ? -128 : y > 127 ? 127 : y;
+            post_input(INPUT_EVENT(INPUT_MOVE, mseinstbuf[1], mseinstbuf[2]));
+            x -= mseinstbuf[1];
+            y -= mseinstbuf[2];
+        } while (x || y);
     } else {
         mseinstbuf[1] += report->x;
         if (mseinstbuf[1] < 0) { mseinstbuf[1] = 0; }
@@ -870,37 +1682,220 @@ static void process_mouse_report(hid_mouse_report_t const *report)
         mseinstbuf[2] += report->y;
         if (mseinstbuf[2] < 0) { mseinstbuf[2] = 0; }
         if (mseinstbuf[2] > 255) { mseinstbuf[2] = 255; }
-        
-        msebuffer[1] = mseinstbuf[1];
-        msebuffer[2] = mseinstbuf[2];
+        post_input(INPUT_EVENT(INPUT_MOVE, mseinstbuf[1], mseinstbuf[2]));
     }
 
-    new_input_msg = true;
+}
 
+static hid_interface_t *find_hid_interface(uint8_t dev_addr, uint8_t instance) {
+    for (uint8_t i = 0; i < CFG_TUH_HID; i++) {
+        if (hidinterfaces[i].dev_addr == dev_addr && hidinterfaces[i].instance == instance) {
+            return &hidinterfaces[i];
+        }
+    }
+    return NULL;
 }
 
-// Invoked when received report from device via interrupt endpoint
-void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* report, uint16_t len)
+// keyboard and mouse present bits in mouse status byte 0, for everything
+// that is plugged in
+static uint8_t hid_present_flags() {
+    uint8_t flags = 0;
+    for (uint8_t i = 0; i < CFG_TUH_HID; i++) {
+        hid_interface_t const *itf = &hidinterfaces[i];
+        for (uint8_t l = 0; itf->dev_addr && l < itf->count; l++) {
+            flags |= itf->layouts[l].kind == REPORT_KEYBOARD ? 0x10 : 0x20;
+        }
+    }
+    return flags;
+}
+
+// the keyboard and mouse present bits in mouse status byte 0
+static void set_present(uint8_t flags) {
+    capture_record(CAPTURE_PRESENT, &flags, 1);
+    mseinstbuf[0] = (mseinstbuf[0] & ~0x30) | flags;
+}
+
+// a key is down while it is down on any keyboard, post what that changed
+static void update_keyboards() {
+    uint32_t keys[REPORT_KEY_WORDS] = { 0 };
+    for (uint8_t i = 0; i < CFG_TUH_HID; i++) {
+        if (hidinterfaces[i].dev_addr) {
+            for (uint8_t w = 0; w < REPORT_KEY_WORDS; w++) {
+                keys[w] |= hidinterfaces[i].keys[w];
+            }
+        }
+    }
+    process_kbd_report(allkeys, keys);
+}
+
+// and a button is down while it is down on any mouse
+static uint8_t hid_buttons() {
+    uint8_t buttons = 0;
+    for (uint8_t i = 0; i < CFG_TUH_HID; i++) {
+        if (hidinterfaces[i].dev_addr) {
+            buttons |= hidinterfaces[i].buttons;
+        }
+    }
+    return buttons;
+}
+
+// Invoked when device with hid interface is mounted
+// Note: if report descriptor length > CFG_TUH_ENUMERATION_BUFSIZE, it will be skipped
+// therefore report_desc = NULL, desc_len = 0
+void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_report, uint16_t desc_len)
 {
-    (void) len;
-    uint8_t const itf_protocol = tuh_hid_interface_protocol(dev_addr, instance);
+    hid_interface_t *itf = find_hid_interface(0, 0);
+    if (!itf) {
+        return;
+    }
 
-    switch(itf_protocol)
-    {
-        case HID_ITF_PROTOCOL_KEYBOARD:
-        process_kbd_report((hid_keyboard_report_t const*) report );
-        break;
+    // find the keyboard and mouse reports, NKRO bitmaps and composite
+    // devices with report IDs included
+    itf->count = 0;
+    memset(itf->keys, 0, sizeof(itf->keys));
+    itf->buttons = 0;
+    if (desc_report && desc_len) {
+        itf->count = parse_report_descriptor(itf->layouts, REPORT_LAYOUT_MAX, desc_report, desc_len);
+    }
 
-        case HID_ITF_PROTOCOL_MOUSE:
-        process_mouse_report((hid_mouse_report_t const*) report );
-        break;
+    if (itf->count == 0) {
+        // no descriptor or nothing in it we understand, a boot keyboard or
+        // mouse can still be read the old way
+        uint8_t const itf_protocol = tuh_hid_interface_protocol(dev_addr, instance);
+        if (itf_protocol == HID_ITF_PROTOCOL_KEYBOARD) {
+            boot_report_layout(&itf->layouts[0], REPORT_KEYBOARD);
+            itf->count = 1;
+        } else if (itf_protocol == HID_ITF_PROTOCOL_MOUSE) {
+            boot_report_layout(&itf->layouts[0], REPORT_MOUSE);
+            itf->count = 1;
+        } else {
+            return;
+        }
+        tuh_hid_set_protocol(dev_addr, instance, HID_PROTOCOL_BOOT);
+    }
+
+    itf->dev_addr = dev_addr;
+    itf->instance = instance;
 
-        default: break;
+    set_present(hid_present_flags());
+    post_input(INPUT_EVENT(INPUT_STATE, mseinstbuf[0], mseinstbuf[3]));
+
+    //  set up report receiving
+    // tuh_hid_report_received_cb() will be invoked when report is available
+    tuh_hid_receive_report(dev_addr, instance);
+}
+
+// Invoked when device with hid interface is un-mounted
+void tuh_hid_umount_cb(uint8_t dev_addr, uint8_t instance)
+{
+    hid_interface_t *itf = find_hid_interface(dev_addr, instance);
+    if (!itf) {
+        return;
+    }
+
+    itf->dev_addr = 0;
+    itf->instance = 0;
+
+    // let go of anything only it was holding down
+    update_keyboards();
+    set_present(hid_present_flags());
+    if (itf->buttons) {
+        itf->buttons = 0;
+        report_mouse_t released = { hid_buttons(), 0, 0, 0 };
+        process_mouse_report(&released);
+    } else {
+        post_input(INPUT_EVENT(INPUT_STATE, mseinstbuf[0], mseinstbuf[3]));
+    }
+}
+
+// Invoked when received report from device via interrupt endpoint
+void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* report, uint16_t len)
+{
+    hid_interface_t *itf = find_hid_interface(dev_addr, instance);
+    report_layout_t const *layout = NULL;
+    if (itf) {
+        layout = find_report_layout(itf->layouts, itf->count, &report, &len);
+    }
+
+    if (layout && layout->kind == REPORT_KEYBOARD) {
+        uint32_t keys[REPORT_KEY_WORDS];
+        // a rollover error leaves everything as it was
+        if (read_keyboard_report(layout, report, len, keys)) {
+            memcpy(itf->keys, keys, sizeof(keys));
+            update_keyboards();
+        }
+    } else if (layout && layout->kind == REPORT_MOUSE) {
+        // motion from every mouse adds up, the buttons are merged
+        report_mouse_t mouse;
+        read_mouse_report(layout, report, len, &mouse);
+        itf->buttons = mouse.buttons;
+        mouse.buttons = hid_buttons();
+        process_mouse_report(&mouse);
     }
 
     // continue to request to receive report
     tuh_hid_receive_report(dev_addr, instance);
 }
 
+//--------------------------------------------------------------------+
+// Input replay
+//--------------------------------------------------------------------+
+
+// one capture record, back through the path it was captured on
+static void replay_record(const uint8_t *r) {
+    const uint8_t *data = &r[CAPTURE_HEADER];
+    switch (r[0]) {
+    case CAPTURE_KEYS: {
+        uint32_t keys[REPORT_KEY_WORDS] = { 0 };
+        for (uint8_t i = 0; i < r[1]; i++) {
+            keys[data[i] >> 5] |= 1u << (data[i] & 31);
+        }
+        process_kbd_report(allkeys, keys);
+        break;
+    }
+    case CAPTURE_MOUSE:
+        if (r[1] == 6) {
+            report_mouse_t mouse = {
+                data[0],
+                (int16_t)(data[1] | data[2] << 8),
+                (int16_t)(data[3] | data[4] << 8),
+                (int8_t)data[5],
+            };
+            process_mouse_report(&mouse);
+        }
+        break;
+    case CAPTURE_PRESENT:
+        if (r[1] == 1) {
+            set_present(data[0]);
+            post_input(INPUT_EVENT(INPUT_STATE, mseinstbuf[0], mseinstbuf[3]));
+        }
+        break;
+    case CAPTURE_I2C:
+        if (r[1] > 0) {
+            i2c_decode(data[0], &data[1], r[1] - 1);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// core0 main loop, everything in input_replay[] that is due by now. false
+// once it has all been played
+static bool input_replay_task() {
+    uint32_t now = time_us_32() - replaystart;
+    while (replayindex + CAPTURE_HEADER <= sizeof(input_replay)
+            && input_replay[replayindex] != CAPTURE_END) {
+        const uint8_t *r = &input_replay[replayindex];
+        uint32_t at;
+        memcpy(&at, &r[2], sizeof(at));
+        if ((int32_t)(now - at) < 0) {
+            return true;
+        }
+        replay_record(r);
+        replayindex += CAPTURE_HEADER + r[1];
+    }
+    return false;
+}
 
-#pragma GCC pop_options
\ No newline at end of file
+#pragma GCC pop_options
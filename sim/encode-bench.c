@@ -0,0 +1,222 @@
+/* Copyright (C) 1883 Thomas Edison - All Rights Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GPLv2 license, which unfortunately won't be
+ * written for another century.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+// pico-pio-usb's table driven tx encoder against the bit at a time loop it
+// replaced, and prepare_tx_data()'s single CRC and encode pass against the
+// copy, CRC and encode passes it used to make. every packet is checked to
+// encode the same before anything is timed, the exit code is 1 on any
+// difference
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "usb_crc.h"
+#include "usb_tx_encode.h"
+
+#define BENCH_MAX_LEN (64 + 4)  // sync, pid, a full endpoint and crc16
+// a stuffed bit for every six, EOP and padding
+#define BENCH_MAX_ENCODED ((BENCH_MAX_LEN * 8 * 7 / 6 + 3) / 4 + 2)
+#define BENCH_PACKETS 1024
+#define BENCH_ROUNDS 200
+
+// the old pio_usb_ll_encode_tx_data()
+static uint8_t encode_bitwise(uint8_t const *buffer, uint8_t buffer_len,
+                              uint8_t *encoded_data) {
+    uint16_t bit_idx = 0;
+    int current_state = 1;
+    int bit_stuffing = 6;
+    for (int idx = 0; idx < buffer_len; idx++) {
+        uint8_t byte = buffer[idx];
+        for (int b = 0; b < 8; b++) {
+            uint8_t byte_idx = bit_idx >> 2;
+            encoded_data[byte_idx] <<= 2;
+            if (byte & (1 << b)) {
+                if (current_state) {
+                    encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_K;
+                } else {
+                    encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_J;
+                }
+                bit_stuffing--;
+            } else {
+                if (current_state) {
+                    encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_J;
+                    current_state = 0;
+                } else {
+                    encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_K;
+                    current_state = 1;
+                }
+                bit_stuffing = 6;
+            }
+
+            bit_idx++;
+
+            if (bit_stuffing == 0) {
+                byte_idx = bit_idx >> 2;
+                encoded_data[byte_idx] <<= 2;
+
+                if (current_state) {
+                    encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_J;
+                    current_state = 0;
+                } else {
+                    encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_K;
+                    current_state = 1;
+                }
+                bit_stuffing = 6;
+                bit_idx++;
+            }
+        }
+    }
+
+    uint8_t byte_idx = bit_idx >> 2;
+    encoded_data[byte_idx] <<= 2;
+    encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_SE0;
+    bit_idx++;
+
+    byte_idx = bit_idx >> 2;
+    encoded_data[byte_idx] <<= 2;
+    encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_COMP;
+    bit_idx++;
+
+    // terminate buffers with K
+    do {
+        byte_idx = bit_idx >> 2;
+        encoded_data[byte_idx] <<= 2;
+        encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_K;
+        bit_idx++;
+    } while (bit_idx & 0x03);
+
+    byte_idx = bit_idx >> 2;
+    return byte_idx;
+}
+
+// the old prepare_tx_data() for a DATA0 packet
+static uint8_t data_three_pass(uint8_t const *payload, uint8_t len, uint8_t *encoded_data) {
+    uint8_t buffer[BENCH_MAX_LEN];
+    buffer[0] = 0x80;   // USB_SYNC
+    buffer[1] = 0xC3;   // USB_PID_DATA0
+    memcpy(buffer + 2, payload, len);
+    uint16_t const crc16 = calc_usb_crc16(payload, len);
+    buffer[2 + len] = crc16 & 0xff;
+    buffer[2 + len + 1] = crc16 >> 8;
+    return pio_usb_ll_encode_tx_data(buffer, len + 4, encoded_data);
+}
+
+// and as it is now
+static uint8_t data_fused(uint8_t const *payload, uint8_t len, uint8_t *encoded_data) {
+    usb_tx_encoder_t enc;
+    usb_tx_encode_start(&enc, encoded_data);
+    usb_tx_encode_byte(&enc, 0x80);
+    usb_tx_encode_byte(&enc, 0xC3);
+    uint16_t crc16 = 0xffff;
+    for (uint16_t idx = 0; idx < len; idx++) {
+        crc16 = update_usb_crc16(crc16, payload[idx]);
+        usb_tx_encode_byte(&enc, payload[idx]);
+    }
+    crc16 ^= 0xffff;
+    usb_tx_encode_byte(&enc, crc16 & 0xff);
+    usb_tx_encode_byte(&enc, crc16 >> 8);
+    return usb_tx_encode_end(&enc, encoded_data);
+}
+
+static bool bench_same(uint8_t (*want_encode)(uint8_t const *, uint8_t, uint8_t *),
+                       uint8_t (*got_encode)(uint8_t const *, uint8_t, uint8_t *),
+                       uint8_t const *packet, uint8_t len) {
+    uint8_t want[BENCH_MAX_ENCODED];
+    uint8_t got[BENCH_MAX_ENCODED];
+    uint8_t want_len = want_encode(packet, len, want);
+    uint8_t got_len = got_encode(packet, len, got);
+    if (got_len != want_len || memcmp(got, want, want_len)) {
+        fprintf(stderr, "encode-bench: %u byte packet encodes differently:", len);
+        for (uint8_t i = 0; i < len; i++) {
+            fprintf(stderr, " %02X", packet[i]);
+        }
+        fprintf(stderr, "\n");
+        return false;
+    }
+    return true;
+}
+
+// random bytes, with long runs of 1s and 0s mixed in for the stuffing
+static uint8_t bench_byte(void) {
+    static const uint8_t runs[] = { 0xFF, 0x00, 0x7F, 0xFE, 0x3F, 0xFC };
+    int r = rand();
+    return (r & 0x300) ? (uint8_t)(r >> 12) : runs[(r >> 12) % sizeof(runs)];
+}
+
+static double bench_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint8_t packets[BENCH_PACKETS][BENCH_MAX_LEN];
+static uint8_t encoded[BENCH_MAX_ENCODED];
+
+// ns per packet for one encoder, over the first len bytes of every packet
+static double bench_time(uint8_t (*encode)(uint8_t const *, uint8_t, uint8_t *), uint8_t len) {
+    volatile uint32_t sink = 0;
+    double start = bench_ns();
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        for (int p = 0; p < BENCH_PACKETS; p++) {
+            sink += encode(packets[p], len, encoded);
+        }
+    }
+    (void)sink;
+    return (bench_ns() - start) / ((double)BENCH_ROUNDS * BENCH_PACKETS);
+}
+
+int main(void) {
+    usb_tx_encode_init();
+    srand(1);
+
+    // every one and two byte packet, then random ones up to a full endpoint
+    uint8_t packet[BENCH_MAX_LEN];
+    for (uint32_t i = 0; i < 0x10000; i++) {
+        packet[0] = i;
+        packet[1] = i >> 8;
+        if ((i < 0x100 && !bench_same(encode_bitwise, pio_usb_ll_encode_tx_data, packet, 1))
+                || !bench_same(encode_bitwise, pio_usb_ll_encode_tx_data, packet, 2)) {
+            return 1;
+        }
+    }
+    for (int p = 0; p < BENCH_PACKETS; p++) {
+        packets[p][0] = 0x80;   // USB_SYNC
+        for (int i = 1; i < BENCH_MAX_LEN; i++) {
+            packets[p][i] = bench_byte();
+        }
+        for (uint8_t len = 1; len <= BENCH_MAX_LEN; len++) {
+            if (!bench_same(encode_bitwise, pio_usb_ll_encode_tx_data, packets[p], len)) {
+                return 1;
+            }
+        }
+        for (uint8_t len = 0; len <= BENCH_MAX_LEN - 4; len++) {
+            if (!bench_same(data_three_pass, data_fused, packets[p], len)) {
+                return 1;
+            }
+        }
+    }
+
+    printf("bytes  bitwise ns  table ns  speedup\n");
+    static const uint8_t lens[] = { 2, 4, 12, BENCH_MAX_LEN };
+    for (size_t i = 0; i < sizeof(lens); i++) {
+        double bitwise = bench_time(encode_bitwise, lens[i]);
+        double table = bench_time(pio_usb_ll_encode_tx_data, lens[i]);
+        printf("%5u  %10.1f  %8.1f  %6.2fx\n", lens[i], bitwise, table, bitwise / table);
+    }
+
+    printf("\npayload  3 pass ns  fused ns  speedup\n");
+    static const uint8_t payloads[] = { 0, 8, BENCH_MAX_LEN - 4 };
+    for (size_t i = 0; i < sizeof(payloads); i++) {
+        double three = bench_time(data_three_pass, payloads[i]);
+        double fused = bench_time(data_fused, payloads[i]);
+        printf("%7u  %9.1f  %8.1f  %6.2fx\n", payloads[i], three, fused, three / fused);
+    }
+    return 0;
+}
@@ -0,0 +1,1049 @@
+/* Copyright (C) 1883 Thomas Edison - All Rights Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GPLv2 license, which unfortunately won't be
+ * written for another century.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+// Host-side simulator for the NES handler on core1
+//
+// the firmware is compiled unchanged against the stand-in headers in
+// sim/include, and the pio0 accesses it makes are backed by a small model
+// of the nesinrst/nesinadv/nesinen/nesoe state machines, their IRQ flags
+// and the five $4017 data pins. a script of $4016 writes and $4017 reads
+// is replayed against that model, and for every read we report how many
+// loop iterations and modelled system clocks it took from the edge that
+// made the old output stale to the right value on the pins
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_pico.h"
+
+// firmware main() becomes an ordinary function, the simulator owns main()
+#define main famikb_main
+#include "pico-usb2famikb.c"
+#undef main
+
+// modelled costs, all in 216 MHz system clocks
+#define SIM_CLOCKS_PER_US 216
+#define SIM_NES_CYCLE 121   // one 2A03 cycle (1.79 MHz)
+#define SIM_OE_LOW 60       // $4017 /OE is only asserted during phi2
+#define SIM_PIO_LATENCY 2   // wait + irq instruction before a flag moves
+#define SIM_BUS_CYCLES 2    // one core1 write into pio0
+#define SIM_ISR_CYCLES 40   // entry, pio_IRQ_handler, exit
+#define SIM_LOOP_CYCLES 24  // nes_handler_thread loop body, default
+#define SIM_NESOE_PASS 6    // one trip round the nesoe poll loop
+
+#define SIM_MAX_EVENTS 65536
+#define SIM_MAX_LINES 4096
+#define SIM_MAX_I2C 1024
+#define SIM_I2C_LEN 40
+#define SIM_MAX_HID 256
+#define SIM_HID_LEN 128
+#define SIM_MAX_REPLAY 16384
+#define SIM_REPLAY_BYTES (1 << 20)
+
+enum {
+    EV_OUT,         // $4016 write lands on OUT0-2
+    EV_OE_FALL,     // $4017 read starts
+    EV_SAMPLE,      // CPU latches D0-D4
+    EV_OE_RISE,     // $4017 read ends
+    EV_KEY,         // core0 posts a keycode
+    EV_USAGE,       // core0 gets a key usage from a keyboard report
+    EV_MOUSE,       // core0 gets a boot mouse report
+    EV_HIDMOUNT,    // a HID interface mounts with a report descriptor
+    EV_HIDREPORT,   // and sends a report
+    EV_I2C,         // the i2c host writes a message
+    EV_I2CREAD,     // the i2c host reads a page back
+    EV_REPLAY,      // core0 replays a capture record
+    EV_END,
+};
+
+typedef struct {
+    uint64_t at;    // when it happens on the wire
+    uint64_t due;   // when the firmware side can see it
+    uint8_t kind;
+    uint8_t value;
+    int8_t dx;
+    int8_t dy;
+    int16_t expect; // -1 for reads without an expected value
+} sim_event_t;
+
+static sim_event_t events[SIM_MAX_EVENTS];
+static uint32_t event_count = 0;
+static uint32_t event_next = 0;
+
+// i2c transfers as they go on the wire, length first. an event's expect
+// is its index in here
+static uint8_t i2cmsgs[SIM_MAX_I2C][SIM_I2C_LEN + 1];
+static uint32_t i2cmsg_count = 0;
+
+// HID report descriptors and reports, length first, indexed the same way
+static uint8_t hidbufs[SIM_MAX_HID][SIM_HID_LEN + 1];
+static uint32_t hidbuf_count = 0;
+
+// capture records in the firmware's own format, an event's expect is its
+// index in replayrecs
+static uint8_t replaybytes[SIM_REPLAY_BYTES];
+static uint32_t replayused = 0;
+static uint32_t replayrecs[SIM_MAX_REPLAY];
+static uint32_t replay_count = 0;
+
+static uint32_t sim_pio0_intr(void);
+pio_hw_t sim_pio0 = { 0, sim_pio0_intr, { 0 } };
+pio_hw_t sim_pio1;
+i2c_inst_t *sim_i2c0 = NULL;
+static uint32_t sim_i2c_data_cmd(void);
+static i2c_hw_t sim_i2c_hw = { .data_cmd_read = sim_i2c_data_cmd };
+
+const pio_program_t nesoe_program = { NULL, 10, -1 };
+const pio_program_t nesinrst_program = { NULL, 8, -1 };
+const pio_program_t nesinadv_program = { NULL, 8, -1 };
+const pio_program_t nesinen_program = { NULL, 8, -1 };
+const pio_program_t nesrow_program = { NULL, 16, -1 };
+
+static struct {
+    uint64_t now;
+    uint64_t spins;         // core1 loop iterations (one pio0->intr poll each)
+    uint32_t loop_cycles;
+
+    uint8_t pins;           // D0-D4 as driven by nesoe
+
+    uint8_t irq_sources;    // pis_interrupt0-3 enabled on PIO0_IRQ_0
+    bool irq_enabled;
+    bool in_isr;
+    irq_handler_t handler;
+
+    bool gpio_in[32];
+    uint8_t out_irqs;       // OUT0-2 with an edge interrupt on core1
+    gpio_irq_callback_t gpio_callback;
+    bool woke;              // the next pio0->intr poll is the wake up pass
+    bool event;             // core1 event register, for __wfe()
+    hardware_alarm_callback_t alarm_callback;
+    bool alarm_armed;
+    uint64_t alarm_at;      // in clocks, like now
+    uint8_t program_offset;
+    uint8_t nesoe_pc;
+    uint8_t nesrow_pc;
+    irq_handler_t i2c_handler;
+    uint16_t i2c_fifo[16];  // the RX FIFO, bytes the host wrote with the
+                            // first data byte flag
+    uint8_t i2c_head;
+    uint8_t i2c_avail;
+    uint8_t i2c_tx;         // the last byte the firmware sent back
+
+    // nesrow, the DMA fed row engine, modelled by what it does rather than
+    // instruction by instruction
+    bool rows;              // sm 3 runs nesrow instead of nesoe
+    bool rows_pull;         // stalled on the pull block for row 0
+    uint8_t rows_y;         // OUT1 level the current row belongs to
+    uint32_t rows_osr;
+    const volatile uint8_t *dma_read;
+    uint32_t dma_count;
+    bool dma_busy;
+    void (*core1)(void);
+    bool core1_running;
+    jmp_buf done;
+
+    // the read in flight
+    uint64_t trigger_at;
+    uint64_t trigger_spins;
+    uint8_t trigger_kind;
+    uint64_t change_at;
+    uint64_t change_spins;
+    int16_t expect;
+
+    // results
+    bool quiet;
+    const char *capture_path;   // -w, where the INPUT_CAPTURE log goes
+    uint32_t reads;
+    uint32_t misses;
+    uint64_t total_cycles;
+    uint64_t total_iters;
+    uint64_t max_cycles;
+    uint64_t max_iters;
+} sim;
+
+// -- event timeline ----------------------------------------------------------
+
+static void sim_push(uint64_t at, uint32_t latency, uint8_t kind, uint8_t value, int8_t dx, int8_t dy, int16_t expect) {
+    if (event_count == SIM_MAX_EVENTS) {
+        fprintf(stderr, "sim: script too long\n");
+        exit(2);
+    }
+    sim_event_t *ev = &events[event_count++];
+    ev->at = at;
+    ev->due = at + latency;
+    ev->kind = kind;
+    ev->value = value;
+    ev->dx = dx;
+    ev->dy = dy;
+    ev->expect = expect;
+
+    // keep it ordered by due, latencies are small so this rarely walks far
+    for (uint32_t i = event_count - 1; i > 0 && events[i-1].due > events[i].due; i--) {
+        sim_event_t t = events[i-1];
+        events[i-1] = events[i];
+        events[i] = t;
+    }
+}
+
+static void sim_trigger(uint64_t at, uint8_t kind) {
+    sim.trigger_at = at;
+    sim.trigger_spins = sim.spins;
+    sim.trigger_kind = kind;
+}
+
+static void sim_raise_irq(void) {
+    // PIO0_IRQ_0 fires on core1 and preempts the loop
+    if (sim.irq_enabled && sim.handler && !sim.in_isr
+            && (sim_pio0.irq & sim.irq_sources)) {
+        sim.in_isr = true;
+        sim.now += SIM_ISR_CYCLES;
+        sim.handler();
+        sim.in_isr = false;
+    }
+}
+
+static void sim_set_pins(uint8_t pins, uint64_t at) {
+    if (pins != sim.pins) {
+        sim.pins = pins;
+        sim.change_at = at;
+        sim.change_spins = sim.spins;
+    }
+}
+
+// nesrow puts the row on D0-D4 while OUT2 enables the keyboard, 1s if not.
+// stalled on a pull it doesn't drive anything new
+static void sim_rows_output(uint64_t at) {
+    if (!sim.rows_pull) {
+        uint8_t pins = (sim_pio0.irq & 4) ? (sim.rows_osr & 0x1f) : 0x1e;
+        sim_set_pins(pins, at);
+    }
+}
+
+// the pull block for row 0 after a restart
+static void sim_rows_pull(uint64_t at) {
+    if (sim.rows_pull && sim.dma_busy && sim.dma_count) {
+        sim.rows_osr = *sim.dma_read++;
+        sim.dma_count--;
+        sim.rows_pull = false;
+    }
+    sim_rows_output(at);
+}
+
+// an OUT1 edge, the next row comes from a pull noblock with X cleared
+// first, so past the last row the OSR is 0, no keys. it goes out after
+// the 5 cycle hold-off on the edge
+static void sim_rows_advance(uint8_t level, uint64_t at) {
+    at += 5;
+    sim.rows_y = level;
+    if (sim.dma_busy && sim.dma_count) {
+        sim.rows_osr = *sim.dma_read++;
+        sim.dma_count--;
+    } else {
+        sim.rows_osr = 0;
+    }
+    sim_rows_output(at);
+}
+
+static void sim_finish_read(uint8_t value) {
+    uint64_t settled = sim.change_at > sim.trigger_at ? sim.change_at : sim.trigger_at;
+    uint64_t cycles = settled - sim.trigger_at;
+    // passes of the core1 loop, counting the one that saw the edge
+    uint64_t iters = sim.change_at > sim.trigger_at ? sim.change_spins - sim.trigger_spins + 1 : 0;
+    bool miss = sim.expect >= 0 && value != (uint8_t)sim.expect;
+
+    if (!sim.quiet) {
+        printf("%6u %10llu  %s  0x%02X  ", sim.reads, (unsigned long long)sim.trigger_at,
+            sim.trigger_kind == EV_OUT ? "4016" : "oe  ", value);
+        if (sim.expect >= 0) {
+            printf("0x%02X", sim.expect);
+        } else {
+            printf("  - ");
+        }
+        printf(" %6llu %7llu  %s\n", (unsigned long long)iters, (unsigned long long)cycles,
+            miss ? "MISS" : "ok");
+    }
+
+    sim.reads++;
+    if (miss) {
+        sim.misses++;
+    } else {
+        sim.total_cycles += cycles;
+        sim.total_iters += iters;
+        if (cycles > sim.max_cycles) { sim.max_cycles = cycles; }
+        if (iters > sim.max_iters) { sim.max_iters = iters; }
+    }
+}
+
+// the I2C0 IRQ, with whatever stat bits brought it in and RX_FULL while the
+// FIFO is over the threshold. the stop and read request are cleared as it
+// returns, the firmware reading clr_ is all it takes on the RP2040
+static void sim_i2c_irq(uint32_t stat) {
+    if (sim.i2c_avail > sim_i2c_hw.rx_tl) {
+        stat |= I2C_IC_INTR_STAT_R_RX_FULL_BITS;
+    }
+    sim_i2c_hw.intr_stat = stat & sim_i2c_hw.intr_mask;
+    if (sim_i2c_hw.intr_stat && sim.i2c_handler) {
+        sim.i2c_handler();
+    }
+    sim_i2c_hw.intr_stat = 0;
+}
+
+static uint32_t sim_i2c_data_cmd(void) {
+    uint32_t value = sim.i2c_fifo[sim.i2c_head];
+    sim.i2c_head = (sim.i2c_head + 1) % 16;
+    sim.i2c_avail--;
+    return value;
+}
+
+// a byte from the host, first marks the one after the address. with the
+// FIFO full the slave holds SCL, so the model has the ISR come in first
+static void sim_i2c_byte(uint8_t value, bool first) {
+    if (sim.i2c_avail == 16) {
+        sim_i2c_irq(0);
+    }
+    sim.i2c_fifo[(sim.i2c_head + sim.i2c_avail++) % 16]
+        = value | (first ? I2C_IC_DATA_CMD_FIRST_DATA_BYTE_BITS : 0);
+}
+
+static void sim_apply(const sim_event_t *ev) {
+    switch (ev->kind) {
+    case EV_OUT: {
+        // nesinrst/nesinadv/nesinen mirror OUT0-2 into IRQ flags 0-2
+        uint32_t flags = sim_pio0.irq & ~0x7u;
+        bool rising = (ev->value & 0x7u) & ~sim_pio0.irq;
+        uint8_t edges = (ev->value ^ sim_pio0.irq) & sim.out_irqs;
+        sim_pio0.irq = flags | (ev->value & 0x7u);
+        sim_trigger(ev->at, EV_OUT);
+        if (edges && !sim.in_isr) {
+            // IO_IRQ_BANK0 on core1, one entry for every pin that moved
+            sim.in_isr = true;
+            sim.now += SIM_ISR_CYCLES;
+            for (uint i = 0; i < 3; i++) {
+                if (edges & (1u << i)) {
+                    sim.gpio_callback(NES_OUT + i, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL);
+                }
+            }
+            sim.in_isr = false;
+        }
+        if (sim.rows) {
+            // nesrow polls OUT1 and OUT2 itself
+            uint8_t level = (ev->value >> 1) & 1;
+            sim_rows_pull(ev->due);
+            if (!sim.rows_pull && level != sim.rows_y) {
+                sim_rows_advance(level, ev->due);
+            }
+        }
+        if (rising) {
+            sim_raise_irq();
+        }
+        break;
+    }
+    case EV_OE_FALL:
+        sim.expect = ev->expect;
+        break;
+    case EV_SAMPLE:
+        sim_finish_read(sim.pins);
+        break;
+    case EV_OE_RISE:
+        // nesoe sees /OE high again on its next pass and raises IRQ 3
+        sim_pio0.irq |= 1u << 3;
+        sim_trigger(ev->at, EV_OE_RISE);
+        sim_raise_irq();
+        break;
+    case EV_KEY:
+        post_key(ev->value);
+        break;
+    case EV_USAGE:
+        post_usage(ev->value, ev->dx);
+        break;
+    case EV_MOUSE: {
+        report_mouse_t report = { ev->value, ev->dx, ev->dy, 0 };
+        process_mouse_report(&report);
+        break;
+    }
+    case EV_HIDMOUNT:
+        // one interface, on device 1
+        tuh_hid_mount_cb(1, 0, &hidbufs[ev->expect][1], hidbufs[ev->expect][0]);
+        break;
+    case EV_HIDREPORT:
+        tuh_hid_report_received_cb(1, 0, &hidbufs[ev->expect][1], hidbufs[ev->expect][0]);
+        break;
+    case EV_I2C: {
+        // the I2C0 IRQ lands on core0 as each byte takes the FIFO over the
+        // threshold, then at the stop. then core0's main loop wakes up and
+        // decodes it
+        const uint8_t *msg = i2cmsgs[ev->expect];
+        sim_i2c_hw.status = I2C_IC_STATUS_SLV_ACTIVITY_BITS;
+        for (uint i = 0; i < msg[0]; i++) {
+            sim_i2c_byte(msg[1 + i], i == 0);
+            if (sim.i2c_avail > sim_i2c_hw.rx_tl) {
+                sim_i2c_irq(0);
+            }
+        }
+        sim_i2c_hw.status = 0;
+        sim_i2c_irq(I2C_IC_INTR_STAT_R_STOP_DET_BITS);
+        i2c_host_task();
+        break;
+    }
+    case EV_I2CREAD: {
+        // page write, restart, then every byte read is checked. the page
+        // byte is under the threshold, so it is still in the FIFO when the
+        // first read request comes in
+        const uint8_t *msg = i2cmsgs[ev->expect];
+        sim_i2c_hw.status = I2C_IC_STATUS_SLV_ACTIVITY_BITS;
+        sim_i2c_byte(msg[1], true);
+        for (uint i = 1; i < msg[0]; i++) {
+            sim_i2c_irq(I2C_IC_INTR_STAT_R_RD_REQ_BITS);
+            if (sim.i2c_tx != msg[1 + i]) {
+                printf("i2c page 0x%02X byte %u  0x%02X  want 0x%02X  MISS\n",
+                    msg[1], i - 1, sim.i2c_tx, msg[1 + i]);
+                sim.misses++;
+            }
+        }
+        sim_i2c_hw.status = 0;
+        sim_i2c_irq(I2C_IC_INTR_STAT_R_STOP_DET_BITS);
+        i2c_host_task();
+        break;
+    }
+    case EV_REPLAY:
+        replay_record(&replaybytes[replayrecs[ev->expect]]);
+        break;
+    case EV_END:
+        longjmp(sim.done, 1);
+    }
+}
+
+static void sim_tick(uint32_t cycles) {
+    sim.now += cycles;
+    while (event_next < event_count && events[event_next].due <= sim.now) {
+        sim_apply(&events[event_next++]);
+    }
+    // the alarm IRQ lands on core0, in between core1 passes
+    if (sim.alarm_armed && sim.alarm_at <= sim.now) {
+        sim.alarm_armed = false;
+        sim.alarm_callback(0);
+    }
+}
+
+// -- pio0 register model -----------------------------------------------------
+
+// the core1 loop polls this once per pass, so this is where we bill the
+// loop body and let the outside world move on
+static uint32_t sim_pio0_intr(void) {
+    // the pass straight after __wfe() was already counted by it
+    if (!sim.woke) {
+        sim.spins++;
+    }
+    sim.woke = false;
+    sim_tick(sim.loop_cycles);
+    return sim_pio0.irq << 8;
+}
+
+uint pio_add_program(PIO pio, const pio_program_t *program) {
+    (void)pio;
+    uint offset = sim.program_offset;
+    sim.program_offset += program->length;
+    if (program == &nesoe_program) {
+        sim.nesoe_pc = offset;
+    } else if (program == &nesrow_program) {
+        sim.nesrow_pc = offset;
+    }
+    return offset;
+}
+
+void pio_gpio_init(PIO pio, uint pin) { (void)pio; (void)pin; }
+
+int pio_sm_set_consecutive_pindirs(PIO pio, uint sm, uint pin_base, uint pin_count, bool is_out) {
+    (void)pio; (void)sm; (void)pin_base; (void)pin_count; (void)is_out;
+    return PICO_OK;
+}
+
+int pio_sm_init(PIO pio, uint sm, uint initial_pc, const pio_sm_config *config) {
+    (void)config;
+    if (pio == pio0 && sm == 3 && initial_pc == sim.nesrow_pc) {
+        sim.rows = true;
+    }
+    return PICO_OK;
+}
+
+void pio_sm_set_enabled(PIO pio, uint sm, bool enabled) { (void)pio; (void)sm; (void)enabled; }
+
+void pio_sm_put(PIO pio, uint sm, uint32_t data) {
+    (void)pio; (void)sm;
+    sim_tick(SIM_BUS_CYCLES);
+    if (!sim.rows) {
+        // nesoe pulls it on its next pass, at worst a whole pass later
+        sim_set_pins(data & 0x1f, sim.now + SIM_NESOE_PASS);
+    }
+}
+
+void pio_sm_exec(PIO pio, uint sm, uint instr) {
+    (void)pio; (void)sm; (void)instr;
+    sim_tick(SIM_BUS_CYCLES);
+    if (sim.rows) {
+        // the only thing forced into nesrow is the jump back to the start
+        sim.rows_y = (sim_pio0.irq >> 1) & 1;
+        sim.rows_pull = true;
+        sim_rows_pull(sim.now);
+    }
+}
+
+bool pio_interrupt_get(PIO pio, uint pio_interrupt_num) {
+    return (pio->irq >> pio_interrupt_num) & 1u;
+}
+
+void pio_interrupt_clear(PIO pio, uint pio_interrupt_num) {
+    pio->irq &= ~(1u << pio_interrupt_num);
+}
+
+void pio_set_irq0_source_enabled(PIO pio, enum pio_interrupt_source source, bool enabled) {
+    if (pio == pio0) {
+        uint8_t bit = 1u << (source - pis_interrupt0);
+        sim.irq_sources = enabled ? sim.irq_sources | bit : sim.irq_sources & ~bit;
+    }
+}
+
+void irq_set_exclusive_handler(uint num, irq_handler_t handler) {
+    if (num == PIO0_IRQ_0) {
+        sim.handler = handler;
+    } else if (num == I2C0_IRQ) {
+        sim.i2c_handler = handler;
+    }
+}
+
+void irq_set_enabled(uint num, bool enabled) {
+    if (num == PIO0_IRQ_0) {
+        sim.irq_enabled = enabled;
+        sim_raise_irq();
+    }
+}
+
+void pio_sm_clear_fifos(PIO pio, uint sm) {
+    (void)pio; (void)sm;
+}
+
+void pio_sm_restart(PIO pio, uint sm) { (void)pio; (void)sm; }
+
+uint pio_get_dreq(PIO pio, uint sm, bool is_tx) {
+    (void)pio; (void)is_tx;
+    return sm;
+}
+
+// -- dma, only the one channel feeding nesrow --------------------------------
+
+int dma_claim_unused_channel(bool required) {
+    (void)required;
+    return 0;
+}
+
+void dma_channel_configure(uint channel, const dma_channel_config *config, volatile void *write_addr,
+        const volatile void *read_addr, uint transfer_count, bool trigger) {
+    (void)channel; (void)config; (void)write_addr;
+    sim.dma_read = read_addr;
+    sim.dma_count = transfer_count;
+    sim.dma_busy = trigger;
+}
+
+void dma_channel_abort(uint channel) {
+    (void)channel;
+    sim_tick(SIM_BUS_CYCLES);
+    sim.dma_busy = false;
+}
+
+void dma_channel_set_read_addr(uint channel, const volatile void *read_addr, bool trigger) {
+    (void)channel;
+    sim_tick(SIM_BUS_CYCLES);
+    sim.dma_read = read_addr;
+    sim.dma_busy |= trigger;
+}
+
+void dma_channel_set_trans_count(uint channel, uint32_t trans_count, bool trigger) {
+    (void)channel;
+    sim_tick(SIM_BUS_CYCLES);
+    sim.dma_count = trans_count;
+    sim.dma_busy |= trigger;
+    if (sim.rows) {
+        sim_rows_pull(sim.now);
+    }
+}
+
+// -- the rest of the board ---------------------------------------------------
+
+void gpio_init(uint gpio) { (void)gpio; }
+
+bool gpio_get(uint gpio) {
+    return gpio < 32 ? sim.gpio_in[gpio] : false;
+}
+
+void gpio_set_irq_enabled_with_callback(uint gpio, uint32_t event_mask, bool enabled, gpio_irq_callback_t callback) {
+    (void)event_mask;
+    if (gpio >= NES_OUT && gpio < NES_OUT + 3) {
+        uint8_t bit = 1u << (gpio - NES_OUT);
+        sim.out_irqs = enabled ? sim.out_irqs | bit : sim.out_irqs & ~bit;
+    }
+    sim.gpio_callback = callback;
+}
+
+void multicore_launch_core1(void (*entry)(void)) {
+    sim.core1 = entry;
+}
+
+// the INPUT_CAPTURE log as a capture file, the same as famikb-capture.py
+// writes from a device
+static void sim_write_capture(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        exit(2);
+    }
+    for (uint32_t i = 0; i + CAPTURE_HEADER <= capturelen; i += CAPTURE_HEADER + capturelog[i + 1]) {
+        const uint8_t *r = &capturelog[i];
+        const uint8_t *data = &r[CAPTURE_HEADER];
+        uint32_t at;
+        memcpy(&at, &r[2], sizeof(at));
+        switch (r[0]) {
+        case CAPTURE_KEYS:
+            fprintf(f, "%u keys", at);
+            break;
+        case CAPTURE_MOUSE:
+            fprintf(f, "%u mouse %02X %d %d %d\n", at, data[0],
+                (int16_t)(data[1] | data[2] << 8), (int16_t)(data[3] | data[4] << 8), (int8_t)data[5]);
+            continue;
+        case CAPTURE_PRESENT:
+            fprintf(f, "%u present", at);
+            break;
+        case CAPTURE_I2C:
+            fprintf(f, "%u i2c", at);
+            break;
+        default:
+            fprintf(f, "# %u kind %u", at, r[0]);
+            break;
+        }
+        for (uint8_t b = 0; b < r[1]; b++) {
+            fprintf(f, " %02X", data[b]);
+        }
+        fprintf(f, "\n");
+    }
+    fclose(f);
+}
+
+// both core0 idle loops end up here, which is where we hand over to core1
+// and the script. core0 work is replayed from the timeline instead
+static void sim_run_core1(void) {
+    sim.core1_running = true;
+    if (setjmp(sim.done) == 0) {
+        sim.core1();
+        fprintf(stderr, "sim: core1 returned\n");
+        exit(2);
+    }
+
+    if (sim.reads) {
+        printf("reads %u  miss %u  iters max %llu mean %.2f  cycles max %llu mean %.2f  spins %u  updates %u  events %u/%u\n",
+            sim.reads, sim.misses,
+            (unsigned long long)sim.max_iters,
+            (double)sim.total_iters / (sim.reads - sim.misses ? sim.reads - sim.misses : 1),
+            (unsigned long long)sim.max_cycles,
+            (double)sim.total_cycles / (sim.reads - sim.misses ? sim.reads - sim.misses : 1),
+            nes_spins, nes_updates, input_applied, input_queued);
+    }
+    if (LATENCY_STATS) {
+        // what a host would read back from LATENCY_PAGE
+        static const char *const names[] = {
+            "keyboard applied", "keyboard strobe", "mouse applied", "mouse strobe",
+        };
+        latency_snapshot();
+        for (uint i = 0; i < LAT_DEVICES * LAT_STAGES; i++) {
+            const uint32_t *l = &latencyout[i * 5];
+            if (l[0]) {
+                printf("latency %-16s n %u  min %u  mean %u  p99 %u  max %u us\n",
+                    names[i], l[0], l[1], l[2], l[3], l[4]);
+            }
+        }
+    }
+    if (INPUT_CAPTURE && sim.capture_path) {
+        sim_write_capture(sim.capture_path);
+    }
+    exit(sim.misses ? 1 : 0);
+}
+
+void tuh_task(void) { sim_run_core1(); }
+
+uint32_t i2c_get_read_available(i2c_inst_t *i2c) {
+    (void)i2c;
+    return sim.i2c_avail;
+}
+
+i2c_hw_t *i2c_get_hw(i2c_inst_t *i2c) {
+    (void)i2c;
+    return &sim_i2c_hw;
+}
+
+void __sev(void) {
+    sim.event = true;
+}
+
+// core1 sleeping, nothing happens until the next event. the i2c host main
+// loop on core0 sleeps here too, which is where we hand over to core1
+
+void __wfe(void) {
+    if (!sim.core1_running) {
+        sim_run_core1();
+    }
+    if (sim.event) {
+        sim.event = false;
+    } else if (event_next < event_count && events[event_next].due > sim.now) {
+        sim.now = events[event_next].due;
+        // or the repeat alarm, if that comes first
+        if (sim.alarm_armed && sim.alarm_at < sim.now) {
+            sim.now = sim.alarm_at;
+        }
+    }
+    sim.spins++;
+    sim.woke = true;
+    sim_tick(0);
+}
+uint32_t time_us_32(void) {
+    return sim.now / SIM_CLOCKS_PER_US;
+}
+
+absolute_time_t make_timeout_time_ms(uint32_t ms) {
+    return sim.now / SIM_CLOCKS_PER_US + (uint64_t)ms * 1000;
+}
+
+int hardware_alarm_claim_unused(bool required) {
+    (void)required;
+    return 0;
+}
+
+void hardware_alarm_set_callback(uint alarm_num, hardware_alarm_callback_t callback) {
+    (void)alarm_num;
+    sim.alarm_callback = callback;
+}
+
+bool hardware_alarm_set_target(uint alarm_num, absolute_time_t t) {
+    (void)alarm_num;
+    sim.alarm_at = t * SIM_CLOCKS_PER_US;
+    sim.alarm_armed = true;
+    return false;
+}
+
+void hardware_alarm_cancel(uint alarm_num) {
+    (void)alarm_num;
+    sim.alarm_armed = false;
+}
+
+void sleep_ms(uint32_t ms) {
+    (void)ms;
+}
+
+uint8_t tuh_hid_interface_protocol(uint8_t dev_addr, uint8_t idx) {
+    (void)dev_addr; (void)idx;
+    return HID_ITF_PROTOCOL_NONE;
+}
+
+void pio_usb_host_get_frame_stats(pio_usb_host_frame_stats_t *stats, bool reset) {
+    (void)reset;
+    memset(stats, 0, sizeof(*stats));
+}
+
+void i2c_write_byte_raw(i2c_inst_t *i2c, uint8_t value) {
+    (void)i2c;
+    sim.i2c_tx = value;
+}
+
+// -- script ------------------------------------------------------------------
+//
+//   mode <0-3>             keyboard mode jumpers, before anything else
+//   i2chost                i2c host enable jumper
+//   key <hex>              keycode from core0 (bit 7 = release)
+//   usage <hex> <0|1>      keyboard usage released or pressed, SENDREPEATS
+//                          repeats go through here
+//   mouse <btn> <dx> <dy>  boot mouse report
+//   hidmount <hex>...      a HID interface mounts, report descriptor bytes
+//   hidreport <hex>...     and sends a report, report ID first if it has them
+//   i2c <hex>...           i2c host write, page byte first, as on the wire
+//   i2cread <page> <hex>...
+//                          i2c host reads a page back, checking every byte
+//   replay <file>          play a capture file from here on, alongside
+//                          what follows it in the script
+//   write <hex>            $4016 write, OUT0-2
+//   read [<hex>]           $4017 read, optionally checking D0-D4
+//   wait <n>               n CPU cycles
+//   repeat <n> ... end     repeat a block
+//
+// each write and read takes one CPU cycle, '#' starts a comment
+//
+// a capture file, as i2chost/famikb-capture.py writes them, has a record
+// to a line, microseconds from the start of the replay and then:
+//
+//   keys <hex>...                  keyboard usages down
+//   mouse <btn> <x> <y> <wheel>    mouse report, buttons in hex
+//   present <hex>                  keyboard and mouse present bits
+//   i2c <hex>...                   i2c host write, page byte first
+//
+// every record goes through replay_record(), as INPUT_REPLAY does on the
+// device
+
+static char *lines[SIM_MAX_LINES];
+static uint32_t line_count = 0;
+static uint64_t script_at = 0;
+static const char *script_path = NULL;
+
+// hex bytes into out, how many or -1 if there are more than max
+static int sim_hex_bytes(char *args, uint8_t *out, int max) {
+    char *end;
+    int n = 0;
+    for (unsigned long b = strtoul(args, &end, 16); end != args; b = strtoul(args, &end, 16)) {
+        if (n == max) {
+            return -1;
+        }
+        out[n++] = b;
+        args = end;
+    }
+    return n;
+}
+
+static void sim_replay(char *args, uint32_t line) {
+    char name[256];
+    char path[512];
+    if (sscanf(args, "%255s", name) != 1) {
+        fprintf(stderr, "sim: line %u: 'replay' without a file\n", line);
+        exit(2);
+    }
+    // relative to the script
+    const char *slash = script_path ? strrchr(script_path, '/') : NULL;
+    if (name[0] != '/' && slash) {
+        snprintf(path, sizeof(path), "%.*s/%s", (int)(slash - script_path), script_path, name);
+    } else {
+        snprintf(path, sizeof(path), "%s", name);
+    }
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        exit(2);
+    }
+
+    char buf[1024];
+    uint32_t n = 0;
+    while (fgets(buf, sizeof(buf), f)) {
+        n++;
+        char kind[16];
+        unsigned long us;
+        int used = 0;
+        if (sscanf(buf, "%lu %15s%n", &us, kind, &used) != 2) {
+            if (sscanf(buf, " %15s", kind) == 1 && kind[0] != '#') {
+                fprintf(stderr, "sim: %s:%u: bad record\n", path, n);
+                exit(2);
+            }
+            continue;
+        }
+        if (replay_count == SIM_MAX_REPLAY || replayused + CAPTURE_HEADER + 255 > SIM_REPLAY_BYTES) {
+            fprintf(stderr, "sim: %s: too many records\n", path);
+            exit(2);
+        }
+        uint8_t *r = &replaybytes[replayused];
+        uint8_t *data = &r[CAPTURE_HEADER];
+        int len = -1;
+        if (!strcmp(kind, "keys")) {
+            r[0] = CAPTURE_KEYS;
+            len = sim_hex_bytes(buf + used, data, 255);
+        } else if (!strcmp(kind, "mouse")) {
+            unsigned btn = 0;
+            int x = 0, y = 0, wheel = 0;
+            r[0] = CAPTURE_MOUSE;
+            if (sscanf(buf + used, "%x %d %d %d", &btn, &x, &y, &wheel) >= 3) {
+                data[0] = btn;
+                data[1] = x & 0xff;
+                data[2] = (x >> 8) & 0xff;
+                data[3] = y & 0xff;
+                data[4] = (y >> 8) & 0xff;
+                data[5] = wheel;
+                len = 6;
+            }
+        } else if (!strcmp(kind, "present")) {
+            r[0] = CAPTURE_PRESENT;
+            len = sim_hex_bytes(buf + used, data, 1);
+        } else if (!strcmp(kind, "i2c")) {
+            r[0] = CAPTURE_I2C;
+            len = sim_hex_bytes(buf + used, data, SIM_I2C_LEN);
+        }
+        if (len < 0) {
+            fprintf(stderr, "sim: %s:%u: bad '%s' record\n", path, n, kind);
+            exit(2);
+        }
+        r[1] = len;
+        uint32_t at = us;
+        memcpy(&r[2], &at, sizeof(at));
+        replayrecs[replay_count] = replayused;
+        replayused += CAPTURE_HEADER + len;
+        sim_push(script_at + (uint64_t)us * SIM_CLOCKS_PER_US, 0, EV_REPLAY, 0, 0, 0, replay_count++);
+    }
+    fclose(f);
+}
+
+static uint32_t sim_parse(uint32_t first, uint32_t stop) {
+    uint32_t i = first;
+    while (i < stop) {
+        char word[16] = "";
+        char *line = lines[i];
+        int used = 0;
+        if (sscanf(line, "%15s%n", word, &used) != 1 || word[0] == '#') {
+            i++;
+            continue;
+        }
+        char *args = line + used;
+
+        if (!strcmp(word, "end")) {
+            return i;
+        } else if (!strcmp(word, "repeat")) {
+            unsigned n = strtoul(args, NULL, 0);
+            uint64_t at = script_at;
+            uint32_t count = event_count;
+            // the first pass also finds the matching end
+            uint32_t last = sim_parse(i + 1, stop);
+            if (last == stop) {
+                fprintf(stderr, "sim: line %u: 'repeat' without 'end'\n", i + 1);
+                exit(2);
+            }
+            if (n == 0) {
+                script_at = at;
+                event_count = count;
+            }
+            for (unsigned r = 1; r < n; r++) {
+                sim_parse(i + 1, stop);
+            }
+            i = last + 1;
+            continue;
+        } else if (!strcmp(word, "mode")) {
+            unsigned mode = strtoul(args, NULL, 0) & 3;
+            sim.gpio_in[KB_MODE] = mode & 1;
+            sim.gpio_in[KB_MODE+1] = (mode >> 1) & 1;
+        } else if (!strcmp(word, "i2chost")) {
+            sim.gpio_in[i2cHOST_ENABLE] = true;
+        } else if (!strcmp(word, "key")) {
+            sim_push(script_at, 0, EV_KEY, strtoul(args, NULL, 16), 0, 0, -1);
+        } else if (!strcmp(word, "usage")) {
+            unsigned usage = 0, pressed = 1;
+            sscanf(args, "%x %u", &usage, &pressed);
+            sim_push(script_at, 0, EV_USAGE, usage, pressed != 0, 0, -1);
+        } else if (!strcmp(word, "mouse")) {
+            unsigned btn = 0;
+            int dx = 0, dy = 0;
+            sscanf(args, "%x %d %d", &btn, &dx, &dy);
+            sim_push(script_at, 0, EV_MOUSE, btn, dx, dy, -1);
+        } else if (!strcmp(word, "hidmount") || !strcmp(word, "hidreport")) {
+            if (hidbuf_count == SIM_MAX_HID) {
+                fprintf(stderr, "sim: too many HID descriptors and reports\n");
+                exit(2);
+            }
+            uint8_t *buf = hidbufs[hidbuf_count];
+            int len = sim_hex_bytes(args, &buf[1], SIM_HID_LEN);
+            if (len < 0) {
+                fprintf(stderr, "sim: line %u: %s too long\n", i + 1, word);
+                exit(2);
+            }
+            buf[0] = len;
+            sim_push(script_at, 0, word[3] == 'm' ? EV_HIDMOUNT : EV_HIDREPORT, 0, 0, 0, hidbuf_count++);
+        } else if (!strcmp(word, "i2c") || !strcmp(word, "i2cread")) {
+            if (i2cmsg_count == SIM_MAX_I2C) {
+                fprintf(stderr, "sim: too many i2c messages\n");
+                exit(2);
+            }
+            uint8_t *msg = i2cmsgs[i2cmsg_count];
+            int len = sim_hex_bytes(args, &msg[1], SIM_I2C_LEN);
+            if (len < 0) {
+                fprintf(stderr, "sim: line %u: i2c message too long\n", i + 1);
+                exit(2);
+            }
+            msg[0] = len;
+            sim_push(script_at, 0, word[3] ? EV_I2CREAD : EV_I2C, 0, 0, 0, i2cmsg_count++);
+        } else if (!strcmp(word, "replay")) {
+            sim_replay(args, i + 1);
+        } else if (!strcmp(word, "write")) {
+            sim_push(script_at, SIM_PIO_LATENCY, EV_OUT, strtoul(args, NULL, 16) & 7, 0, 0, -1);
+            script_at += SIM_NES_CYCLE;
+        } else if (!strcmp(word, "read")) {
+            char *end;
+            long expect = strtol(args, &end, 16);
+            if (end == args) {
+                expect = -1;
+            }
+            sim_push(script_at, 0, EV_OE_FALL, 0, 0, 0, expect < 0 ? -1 : expect & 0x1f);
+            sim_push(script_at + SIM_OE_LOW - 1, 0, EV_SAMPLE, 0, 0, 0, -1);
+            sim_push(script_at + SIM_OE_LOW, SIM_PIO_LATENCY, EV_OE_RISE, 0, 0, 0, -1);
+            script_at += SIM_NES_CYCLE;
+        } else if (!strcmp(word, "wait")) {
+            script_at += (uint64_t)strtoul(args, NULL, 0) * SIM_NES_CYCLE;
+        } else {
+            fprintf(stderr, "sim: line %u: unknown command '%s'\n", i + 1, word);
+            exit(2);
+        }
+        i++;
+    }
+    return i;
+}
+
+static void sim_load(FILE *f) {
+    char buf[256];
+    while (fgets(buf, sizeof(buf), f)) {
+        if (line_count == SIM_MAX_LINES) {
+            fprintf(stderr, "sim: script too long\n");
+            exit(2);
+        }
+        size_t len = strlen(buf) + 1;
+        lines[line_count] = malloc(len);
+        memcpy(lines[line_count++], buf, len);
+    }
+    if (sim_parse(0, line_count) != line_count) {
+        fprintf(stderr, "sim: 'end' without 'repeat'\n");
+        exit(2);
+    }
+    // give core1 a moment to settle the last read before stopping
+    sim_push(script_at + SIM_NES_CYCLE, 0, EV_END, 0, 0, 0, -1);
+}
+
+int main(int argc, char **argv) {
+    const char *path = NULL;
+    sim.loop_cycles = SIM_LOOP_CYCLES;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-q")) {
+            sim.quiet = true;
+        } else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            sim.loop_cycles = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+            sim.capture_path = argv[++i];
+        } else if (argv[i][0] != '-' && !path) {
+            path = argv[i];
+        } else {
+            fprintf(stderr, "usage: %s [-q] [-c loop_cycles] [-w capture] [script]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    script_path = path;
+    FILE *f = path ? fopen(path, "r") : stdin;
+    if (!f) {
+        perror(path);
+        return 2;
+    }
+    sim_load(f);
+    if (f != stdin) {
+        fclose(f);
+    }
+
+    if (!sim.quiet) {
+        printf("  read    trigger  from  pins  want  iters  cycles\n");
+    }
+
+    // boots like the real thing, core0 hands over to us from its idle loop
+    famikb_main();
+    return 0;
+}
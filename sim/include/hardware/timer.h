@@ -0,0 +1,4 @@
+// host-side stand-in for the pico-sdk/tinyusb header of the same name,
+// everything the firmware touches is declared in sim_pico.h
+#pragma once
+#include "sim_pico.h"
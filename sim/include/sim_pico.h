@@ -0,0 +1,294 @@
+/* Copyright (C) 1883 Thomas Edison - All Rights Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GPLv2 license, which unfortunately won't be
+ * written for another century.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#pragma once
+
+// just enough of the pico-sdk and tinyusb surface for pico-usb2famikb.c and
+// usb2famikb-lib to compile on a plain host. everything that touches pio0 is
+// implemented by the register model in famikb-sim.c, the rest are no-ops
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "pio_usb_configuration.h"
+
+typedef unsigned int uint;
+
+#define PICO_OK 0
+#define PICO_DEFAULT_LED_PIN 25
+
+// -- platform ----------------------------------------------------------------
+// no flash or RAM sections on the host
+#define __force_inline __attribute__((always_inline))
+#define __not_in_flash(group)
+#define __not_in_flash_func(func_name) func_name
+#define __no_inline_not_in_flash_func(func_name) __attribute__((noinline)) func_name
+#define __time_critical_func(func_name) func_name
+static inline void hw_set_bits(volatile uint32_t *addr, uint32_t mask) { *addr |= mask; }
+
+// -- pio ---------------------------------------------------------------------
+// reads of pio->intr go through the model so that core1 polling it is
+// what moves simulated time forward
+typedef struct {
+    volatile uint32_t irq;
+    uint32_t (*intr_read)(void);
+    volatile uint32_t txf[4];
+} pio_hw_t;
+#define intr intr_read()
+typedef pio_hw_t *PIO;
+
+extern pio_hw_t sim_pio0;
+extern pio_hw_t sim_pio1;
+#define pio0 (&sim_pio0)
+#define pio1 (&sim_pio1)
+
+typedef struct {
+    const uint16_t *instructions;
+    uint8_t length;
+    int8_t origin;
+} pio_program_t;
+
+typedef struct {
+    uint32_t clkdiv;
+    uint32_t execctrl;
+    uint32_t shiftctrl;
+    uint32_t pinctrl;
+} pio_sm_config;
+
+enum pio_src_dest {
+    pio_pins = 0,
+    pio_x = 1,
+    pio_y = 2,
+    pio_null = 3,
+    pio_pindirs = 4,
+    pio_exec_mov = 4,
+    pio_status = 5,
+    pio_pc = 5,
+    pio_isr = 6,
+    pio_osr = 7,
+    pio_exec_out = 7,
+};
+
+enum pio_interrupt_source {
+    pis_interrupt0 = 8,
+    pis_interrupt1 = 9,
+    pis_interrupt2 = 10,
+    pis_interrupt3 = 11,
+};
+
+static inline uint pio_encode_jmp(uint addr) {
+    return addr & 0x1fu;
+}
+
+static inline void sm_config_set_in_pins(pio_sm_config *c, uint in_base) { (void)c; (void)in_base; }
+static inline void sm_config_set_out_pins(pio_sm_config *c, uint out_base, uint out_count) { (void)c; (void)out_base; (void)out_count; }
+static inline void sm_config_set_set_pins(pio_sm_config *c, uint set_base, uint set_count) { (void)c; (void)set_base; (void)set_count; }
+static inline void sm_config_set_jmp_pin(pio_sm_config *c, uint pin) { (void)c; (void)pin; }
+static inline void sm_config_set_in_shift(pio_sm_config *c, bool shift_right, bool autopush, uint push_threshold) { (void)c; (void)shift_right; (void)autopush; (void)push_threshold; }
+static inline void sm_config_set_out_shift(pio_sm_config *c, bool shift_right, bool autopull, uint pull_threshold) { (void)c; (void)shift_right; (void)autopull; (void)pull_threshold; }
+
+uint pio_add_program(PIO pio, const pio_program_t *program);
+void pio_gpio_init(PIO pio, uint pin);
+int pio_sm_set_consecutive_pindirs(PIO pio, uint sm, uint pin_base, uint pin_count, bool is_out);
+int pio_sm_init(PIO pio, uint sm, uint initial_pc, const pio_sm_config *config);
+void pio_sm_set_enabled(PIO pio, uint sm, bool enabled);
+void pio_sm_put(PIO pio, uint sm, uint32_t data);
+void pio_sm_exec(PIO pio, uint sm, uint instr);
+bool pio_interrupt_get(PIO pio, uint pio_interrupt_num);
+void pio_interrupt_clear(PIO pio, uint pio_interrupt_num);
+void pio_set_irq0_source_enabled(PIO pio, enum pio_interrupt_source source, bool enabled);
+void pio_sm_clear_fifos(PIO pio, uint sm);
+void pio_sm_restart(PIO pio, uint sm);
+uint pio_get_dreq(PIO pio, uint sm, bool is_tx);
+
+// the generated pio-usb2famikb.pio.h, only the parts usb2famikb.c uses
+extern const pio_program_t nesoe_program;
+extern const pio_program_t nesinrst_program;
+extern const pio_program_t nesinadv_program;
+extern const pio_program_t nesinen_program;
+extern const pio_program_t nesrow_program;
+static inline pio_sm_config sim_pio_default_config(uint offset) {
+    pio_sm_config c = { 0, offset, 0, 0 };
+    return c;
+}
+#define nesoe_program_get_default_config sim_pio_default_config
+#define nesinrst_program_get_default_config sim_pio_default_config
+#define nesinadv_program_get_default_config sim_pio_default_config
+#define nesinen_program_get_default_config sim_pio_default_config
+#define nesrow_program_get_default_config sim_pio_default_config
+
+// -- dma ---------------------------------------------------------------------
+enum dma_channel_transfer_size {
+    DMA_SIZE_8 = 0,
+    DMA_SIZE_16 = 1,
+    DMA_SIZE_32 = 2,
+};
+
+typedef struct {
+    uint32_t ctrl;
+} dma_channel_config;
+
+static inline dma_channel_config dma_channel_get_default_config(uint channel) {
+    dma_channel_config c = { channel };
+    return c;
+}
+static inline void channel_config_set_transfer_data_size(dma_channel_config *c, enum dma_channel_transfer_size size) { (void)c; (void)size; }
+static inline void channel_config_set_read_increment(dma_channel_config *c, bool incr) { (void)c; (void)incr; }
+static inline void channel_config_set_write_increment(dma_channel_config *c, bool incr) { (void)c; (void)incr; }
+static inline void channel_config_set_dreq(dma_channel_config *c, uint dreq) { (void)c; (void)dreq; }
+
+int dma_claim_unused_channel(bool required);
+void dma_channel_configure(uint channel, const dma_channel_config *config, volatile void *write_addr,
+    const volatile void *read_addr, uint transfer_count, bool trigger);
+void dma_channel_abort(uint channel);
+void dma_channel_set_read_addr(uint channel, const volatile void *read_addr, bool trigger);
+void dma_channel_set_trans_count(uint channel, uint32_t trans_count, bool trigger);
+
+// -- irq ---------------------------------------------------------------------
+typedef void (*irq_handler_t)(void);
+#define PIO0_IRQ_0 7
+void irq_set_exclusive_handler(uint num, irq_handler_t handler);
+void irq_set_enabled(uint num, bool enabled);
+
+// -- sync ------------------------------------------------------------------
+// both "cores" are one host thread, a compiler barrier is all it takes
+static inline void __dmb(void) { __asm__ volatile ("" ::: "memory"); }
+// a sleeping core1 just fast-forwards to the next event, unless the event
+// register is already set
+void __sev(void);
+void __wfe(void);
+static inline uint32_t save_and_disable_interrupts(void) { return 0; }
+static inline void restore_interrupts(uint32_t status) { (void)status; }
+
+// -- gpio / clocks / multicore ----------------------------------------------
+#define GPIO_IN false
+#define GPIO_OUT true
+#define GPIO_FUNC_I2C 3
+#define GPIO_IRQ_EDGE_FALL 0x4u
+#define GPIO_IRQ_EDGE_RISE 0x8u
+
+typedef void (*gpio_irq_callback_t)(uint gpio, uint32_t event_mask);
+
+void gpio_init(uint gpio);
+static inline void gpio_set_dir(uint gpio, bool out) { (void)gpio; (void)out; }
+static inline void gpio_pull_up(uint gpio) { (void)gpio; }
+static inline void gpio_pull_down(uint gpio) { (void)gpio; }
+static inline void gpio_set_function(uint gpio, uint fn) { (void)gpio; (void)fn; }
+static inline void gpio_put(uint gpio, bool value) { (void)gpio; (void)value; }
+bool gpio_get(uint gpio);
+void gpio_set_irq_enabled_with_callback(uint gpio, uint32_t event_mask, bool enabled, gpio_irq_callback_t callback);
+
+static inline bool set_sys_clock_khz(uint32_t freq_khz, bool required) { (void)freq_khz; (void)required; return true; }
+void sleep_ms(uint32_t ms);
+uint32_t time_us_32(void);
+
+// -- timer -------------------------------------------------------------------
+// the one hardware alarm the firmware claims fires from the model's clock
+typedef uint64_t absolute_time_t;
+typedef void (*hardware_alarm_callback_t)(uint alarm_num);
+absolute_time_t make_timeout_time_ms(uint32_t ms);
+int hardware_alarm_claim_unused(bool required);
+void hardware_alarm_set_callback(uint alarm_num, hardware_alarm_callback_t callback);
+bool hardware_alarm_set_target(uint alarm_num, absolute_time_t t);
+void hardware_alarm_cancel(uint alarm_num);
+
+static inline void multicore_reset_core1(void) { }
+void multicore_launch_core1(void (*entry)(void));
+
+// -- i2c ---------------------------------------------------------------------
+typedef struct i2c_inst i2c_inst_t;
+extern i2c_inst_t *sim_i2c0;
+#define i2c0 sim_i2c0
+
+// the DW_apb_i2c registers the I2C0 IRQ handler uses. data_cmd pops the
+// RX FIFO through the model, the clr_ registers are cleared by it as each
+// interrupt returns
+typedef struct {
+    volatile uint32_t con;
+    volatile uint32_t rx_tl;
+    volatile uint32_t enable;
+    volatile uint32_t status;
+    volatile uint32_t intr_mask;
+    volatile uint32_t intr_stat;
+    volatile uint32_t clr_stop_det;
+    volatile uint32_t clr_rd_req;
+    volatile uint32_t clr_tx_abrt;
+    uint32_t (*data_cmd_read)(void);
+} i2c_hw_t;
+#define data_cmd data_cmd_read()
+
+#define I2C0_IRQ 23
+#define I2C_IC_CON_RX_FIFO_FULL_HLD_CTRL_BITS 0x200u
+#define I2C_IC_INTR_STAT_R_RX_FULL_BITS 0x4u
+#define I2C_IC_INTR_STAT_R_RD_REQ_BITS 0x20u
+#define I2C_IC_INTR_STAT_R_TX_ABRT_BITS 0x40u
+#define I2C_IC_INTR_STAT_R_STOP_DET_BITS 0x200u
+#define I2C_IC_INTR_MASK_M_RX_FULL_BITS 0x4u
+#define I2C_IC_INTR_MASK_M_RD_REQ_BITS 0x20u
+#define I2C_IC_INTR_MASK_M_TX_ABRT_BITS 0x40u
+#define I2C_IC_INTR_MASK_M_STOP_DET_BITS 0x200u
+#define I2C_IC_STATUS_SLV_ACTIVITY_BITS 0x40u
+#define I2C_IC_DATA_CMD_DAT_BITS 0xffu
+#define I2C_IC_DATA_CMD_FIRST_DATA_BYTE_BITS 0x800u
+
+static inline uint i2c_init(i2c_inst_t *i2c, uint baudrate) { (void)i2c; return baudrate; }
+static inline void i2c_set_slave_mode(i2c_inst_t *i2c, bool slave, uint8_t addr) { (void)i2c; (void)slave; (void)addr; }
+i2c_hw_t *i2c_get_hw(i2c_inst_t *i2c);
+uint32_t i2c_get_read_available(i2c_inst_t *i2c);
+void i2c_write_byte_raw(i2c_inst_t *i2c, uint8_t value);
+
+// -- pio-usb -----------------------------------------------------------------
+// no USB bus in the model, the frame stats stay zero
+#include "usb_definitions.h"
+void pio_usb_host_get_frame_stats(pio_usb_host_frame_stats_t *stats, bool reset);
+
+// -- tinyusb host ------------------------------------------------------------
+#include "tusb_config.h"
+
+#define TUH_CFGID_RPI_PIO_USB_CONFIGURATION 100
+
+enum {
+    HID_PROTOCOL_BOOT = 0,
+    HID_PROTOCOL_REPORT = 1,
+};
+
+enum {
+    HID_ITF_PROTOCOL_NONE = 0,
+    HID_ITF_PROTOCOL_KEYBOARD = 1,
+    HID_ITF_PROTOCOL_MOUSE = 2,
+};
+
+enum {
+    MOUSE_BUTTON_LEFT = 1u << 0,
+    MOUSE_BUTTON_RIGHT = 1u << 1,
+    MOUSE_BUTTON_MIDDLE = 1u << 2,
+    MOUSE_BUTTON_BACKWARD = 1u << 3,
+    MOUSE_BUTTON_FORWARD = 1u << 4,
+};
+
+typedef struct {
+    uint8_t modifier;
+    uint8_t reserved;
+    uint8_t keycode[6];
+} hid_keyboard_report_t;
+
+typedef struct {
+    uint8_t buttons;
+    int8_t x;
+    int8_t y;
+    int8_t wheel;
+    int8_t pan;
+} hid_mouse_report_t;
+
+static inline bool tuh_configure(uint8_t rhport, uint32_t cfg_id, const void *cfg_param) { (void)rhport; (void)cfg_id; (void)cfg_param; return true; }
+static inline bool tuh_init(uint8_t rhport) { (void)rhport; return true; }
+void tuh_task(void);
+uint8_t tuh_hid_interface_protocol(uint8_t dev_addr, uint8_t idx);
+static inline bool tuh_hid_receive_report(uint8_t dev_addr, uint8_t idx) { (void)dev_addr; (void)idx; return true; }
+static inline void tuh_hid_set_default_protocol(uint8_t protocol) { (void)protocol; }
+static inline bool tuh_hid_set_protocol(uint8_t dev_addr, uint8_t idx, uint8_t protocol) { (void)dev_addr; (void)idx; (void)protocol; return true; }
@@ -84,7 +84,8 @@
 //--------------------------------------------------------------------
 
 // Size of buffer to hold descriptors and other data used for enumeration
-#define CFG_TUH_ENUMERATION_BUFSIZE 256
+// NKRO and gaming keyboard report descriptors easily go past 256 bytes
+#define CFG_TUH_ENUMERATION_BUFSIZE 1024
 
 #define CFG_TUH_HUB                 1
 // max device support (excluding hub device)
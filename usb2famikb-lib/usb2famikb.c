@@ -13,6 +13,7 @@
 #include "usb2famikb.h"
 
 #include "hardware/clocks.h"
+#include "hardware/dma.h"
 #include "hardware/pio.h"
 
 // we are going to use pio0 for all our stuff
@@ -22,10 +23,18 @@ static const uint neskben_sm = 2;
 static const uint neskbadv_sm = 1;
 static const uint neskbrst_sm = 0;
 static const uint nesoe_sm = 3;
+// the DMA fed row engine takes the nesoe slot, they never run together
+static const uint nesrow_sm = 3;
 
 // we need the offset for output enable for other things
 static uint nesoeos;
 
+// row engine program offset, DMA channel and the table it walks
+static uint nesrowos;
+static int nesrow_dma = -1;
+static const volatile uint8_t *nesrow_table;
+static uint nesrow_count;
+
 
 void usb2famikb_init(uint nesin_gpio, uint nesoe1_gpio, uint nesoe2_gpio, uint kbout_gpio, uint usb2kbmode) {
 
@@ -115,12 +124,74 @@ void usb2famikb_init(uint nesin_gpio, uint nesoe1_gpio, uint nesoe2_gpio, uint k
 }
 
 void usb2famikb_putkb(const uint32_t nesout) {
-    // we basically just force the SM to pull this data now, no matter
-    // what it is doing, and put it on the output
-    // then it returns back to where it was
+    // nesoe picks the newest word out of its FIFO on its next pass and
+    // keeps it on the output until there is another one
     pio_sm_put(picofamikb_pio, nesoe_sm, nesout);
-    pio_sm_exec(picofamikb_pio, nesoe_sm, pio_encode_pull(false, false));
-    pio_sm_exec(picofamikb_pio, nesoe_sm, pio_encode_out(pio_pins, 5));
+}
+
+void usb2famikb_init_dma(uint nesin_gpio, uint kbout_gpio, const volatile uint8_t *rows, uint rowcount) {
+
+    for (uint8_t i = nesin_gpio; i < nesin_gpio+3; i++) {
+        gpio_init(i);
+    }
+
+    for (uint8_t i = kbout_gpio; i < kbout_gpio+5; i++) {
+        pio_gpio_init(picofamikb_pio, i);
+    }
+
+    // the strobe still comes from nesinrst, core1 restarts the rows on it
+    uint neskbrstos = pio_add_program(picofamikb_pio, &nesinrst_program);
+    pio_sm_config neskbrstc = nesinrst_program_get_default_config(neskbrstos);
+
+    pio_sm_set_consecutive_pindirs(picofamikb_pio, neskbrst_sm, nesin_gpio, 1, false);
+    sm_config_set_in_pins(&neskbrstc, nesin_gpio);
+    sm_config_set_in_shift(&neskbrstc, false, false, 32);
+    sm_config_set_jmp_pin(&neskbrstc, nesin_gpio);
+
+    pio_sm_init(picofamikb_pio, neskbrst_sm, neskbrstos, &neskbrstc);
+    pio_sm_set_enabled(picofamikb_pio, neskbrst_sm, true);
+
+    // row advance and enable are read straight off OUT1/OUT2
+    nesrowos = pio_add_program(picofamikb_pio, &nesrow_program);
+    pio_sm_config nesrowc = nesrow_program_get_default_config(nesrowos);
+
+    pio_sm_set_consecutive_pindirs(picofamikb_pio, nesrow_sm, nesin_gpio+1, 2, false);
+    sm_config_set_in_pins(&nesrowc, nesin_gpio+1);
+    sm_config_set_in_shift(&nesrowc, false, false, 32);
+    sm_config_set_jmp_pin(&nesrowc, nesin_gpio+2);
+
+    pio_sm_set_consecutive_pindirs(picofamikb_pio, nesrow_sm, kbout_gpio, 5, true);
+    sm_config_set_out_pins(&nesrowc, kbout_gpio, 5);
+    sm_config_set_set_pins(&nesrowc, kbout_gpio, 5);
+    sm_config_set_out_shift(&nesrowc, true, false, 32);
+
+    pio_sm_init(picofamikb_pio, nesrow_sm, nesrowos, &nesrowc);
+
+    // one byte per row into the TX FIFO, paced by the SM pulling
+    nesrow_table = rows;
+    nesrow_count = rowcount;
+    nesrow_dma = dma_claim_unused_channel(true);
+    dma_channel_config dmac = dma_channel_get_default_config(nesrow_dma);
+    channel_config_set_transfer_data_size(&dmac, DMA_SIZE_8);
+    channel_config_set_read_increment(&dmac, true);
+    channel_config_set_write_increment(&dmac, false);
+    channel_config_set_dreq(&dmac, pio_get_dreq(picofamikb_pio, nesrow_sm, true));
+    dma_channel_configure(nesrow_dma, &dmac, &picofamikb_pio->txf[nesrow_sm], rows, rowcount, false);
+
+    usb2famikb_restart_dma();
+}
+
+void usb2famikb_restart_dma(void) {
+    // back to row 0, throwing away whatever was already prefetched
+    pio_sm_set_enabled(picofamikb_pio, nesrow_sm, false);
+    dma_channel_abort(nesrow_dma);
+    pio_sm_clear_fifos(picofamikb_pio, nesrow_sm);
+    pio_sm_restart(picofamikb_pio, nesrow_sm);
+    pio_sm_exec(picofamikb_pio, nesrow_sm, pio_encode_jmp(nesrowos));
+
+    dma_channel_set_read_addr(nesrow_dma, nesrow_table, false);
+    dma_channel_set_trans_count(nesrow_dma, nesrow_count, true);
+    pio_sm_set_enabled(picofamikb_pio, nesrow_sm, true);
 }
 
 #pragma GCC pop_options
\ No newline at end of file
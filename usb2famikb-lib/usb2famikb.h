@@ -8,6 +8,11 @@ void usb2famikb_init(uint nesin_gpio, uint nesoe1_gpio, uint nesoe2_gpio, uint k
 
 void usb2famikb_putkb(const uint32_t nesout);
 
+// family basic rows answered by PIO+DMA from a table of D0-D4 values
+void usb2famikb_init_dma(uint nesin_gpio, uint kbout_gpio, const volatile uint8_t *rows, uint rowcount);
+
+void usb2famikb_restart_dma(void);
+
 #ifdef __cplusplus
 }
 #endif